@@ -1,6 +1,19 @@
+#define _GNU_SOURCE  // for memfd_create
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 typedef struct ConditionCodes {
   // zero, set when result == 0
@@ -18,6 +31,132 @@ typedef struct ConditionCodes {
   uint8_t   pad:3;
 } ConditionCodes;
 
+struct State8080;
+
+// Called when an event comes due. `when` is the cycle it was scheduled for,
+// which can be a little before state->cycles since events are only checked
+// between slices of execution.
+typedef void (*EventFn)(struct State8080 *state, uint64_t when, int arg);
+
+typedef struct Event {
+  uint64_t  when;
+  EventFn   fn;
+  int       arg;
+} Event;
+
+// Pending events ordered by cycle, earliest first. There are only ever a
+// couple of them, so a sorted array is plenty.
+#define MAX_EVENTS 8
+typedef struct Scheduler {
+  Event     events[MAX_EVENTS];
+  int       count;
+} Scheduler;
+
+// I/O port callbacks. They run in the middle of an instruction, so they can
+// rely on state->cycles being current but must not touch the registers.
+typedef uint8_t (*PortInFn)(struct State8080 *state, uint8_t port);
+typedef void (*PortOutFn)(struct State8080 *state, uint8_t port, uint8_t value);
+
+// What IN and OUT are wired to, one callback per port. Unused ports point at
+// do-nothing callbacks so IN and OUT are always a single indirect call. A
+// table is read-only once set up and can be shared by any number of CPUs.
+typedef struct Ports {
+  PortInFn  in[256];
+  PortOutFn out[256];
+} Ports;
+
+// A device's side of a CPU store to a page it is mapped on
+typedef void (*MemWriteFn)(struct State8080 *state, uint16_t adr,
+                           uint8_t value);
+
+/**
+ * What each 256-byte page of the address space is wired to. Loads always
+ * come straight from state->memory, one indexed load, and so do stores to a
+ * page with no handler. Where the board repeats memory at several
+ * addresses the MMU maps the same bytes at each of them (see
+ * MapMemory8080), so a mirror costs a load nothing either. A page with a
+ * write handler gets the CPU's stores to it instead; they take the slow
+ * path that stores over cached code already take, so RAM pays no extra
+ * branch for it. Like Ports, a map is read-only once set up and can be
+ * shared by any number of CPUs.
+ */
+typedef struct MemoryMap {
+  MemWriteFn write[256];  // NULL for a plain store
+  // The page number bits the board decodes, all low ones: pages that agree
+  // in these bits are the same memory
+  uint8_t    page_mask;
+} MemoryMap;
+
+// The Midway 8080 board's I/O: three input ports, the bit shifter and the
+// sound latches
+typedef struct MidwayIO {
+  // The last two bytes written to port 4, newest in the high byte
+  uint16_t  shift;
+  // Port 2, how far left to shift before reading port 3
+  uint8_t   shift_offset;
+  // Switches and buttons on input ports 0-2, see the INPUT_ bits
+  uint8_t   in_port[3];
+  // Last values written to sound ports 3 and 5
+  uint8_t   sound[2];
+} MidwayIO;
+
+// One decoded instruction. The operand is already assembled and the cycle
+// count looked up, so running it needs no fetch from guest memory.
+typedef struct MicroOp {
+  uint16_t  op;     // opcode, UOP_END for "carry on at pc", or a UOP_ loop
+  uint16_t  imm;    // operand byte or word
+  uint16_t  pc;     // address of the instruction
+  uint16_t  rest;   // cycles of the ops after this one in the block
+  uint8_t   cycles; // from Cycles8080, i.e. not counting a taken call/return
+  uint8_t   len;
+} MicroOp;
+
+#define UOP_END         256
+#define UOP_STOP        265  // breakpoint page ahead, return to RunDebug8080
+// Whole loops recognised by DecodeBlock, see Idioms
+#define UOP_COPY        257  // LDAX D / MOV M,A / INX H / INX D / DCR B / JNZ
+#define UOP_FILL        258  // MVI M,x / INX H / MOV A,H / CPI y / JNZ
+#define UOP_COLUMN_COPY 259  // as UOP_COPY, but HL steps by a stride
+#define UOP_COLUMN_FILL 260  // MOV M,A, with HL stepping by a stride
+#define UOP_COUNT       261  // count the nonzero bytes at HL
+#define UOP_SCAN        262  // find the first nonzero byte at HL
+#define UOP_WAIT_ANA    263  // LDA adr / ANA A / JNZ, until it reads zero
+#define UOP_WAIT_DCR    264  // LDA adr / DCR A / JNZ, until it reads one
+#define UOP_LAST        UOP_STOP
+#define BLOCK_MAX_OPS   32
+#define BLOCK_CACHE_SIZE 1024  // blocks, a power of two
+
+// A run of instructions decoded from `pc` on. It runs on through conditional
+// jumps (not taken just means the next op), and ends after an unconditional
+// transfer or HLT, or with a UOP_END once BLOCK_MAX_OPS is reached, so the
+// last op always says where execution goes next.
+typedef struct Block {
+  uint16_t  pc;
+  uint16_t  end;    // address just past the last instruction
+  uint16_t  cycles; // all ops, as if no conditional call or return is taken
+  uint8_t   valid;
+  uint8_t   count;
+  MicroOp   ops[BLOCK_MAX_OPS + 1];
+} Block;
+
+// Bits of State8080.page_flags
+#define PAGE_CODE     1  // holds some cached block's code
+#define PAGE_WATCH    2  // has a write watchpoint, see Debugger
+#define PAGE_HANDLER  4  // the memory map has a write handler for it
+
+// Direct-mapped cache of decoded blocks, keyed by guest PC
+typedef struct BlockCache {
+  Block     blocks[BLOCK_CACHE_SIZE];
+  // Nonzero for each page with a breakpoint: blocks stop short of these
+  uint8_t   break_page[256];
+  // Set while RunDebug8080 drives the engine, which then stops short
+  // rather than finish a slice on Run8080
+  uint8_t   stepping;
+  uint64_t  lookups;
+  uint64_t  decodes;
+  uint64_t  invalidations;
+} BlockCache;
+
 typedef struct State8080 {
   uint8_t   a;
   uint8_t   b;
@@ -29,302 +168,765 @@ typedef struct State8080 {
   uint16_t  sp;
   uint16_t  pc;
   uint8_t   *memory;
+  // What each page of memory is wired to
+  const MemoryMap *map;
+  // PAGE_ bits for each 256-byte page. Nonzero sends a CPU store to the
+  // page down StoreSlowPath, which hands it to the map's handler, throws
+  // away blocks decoded from the page and checks the write watchpoints.
+  uint8_t   page_flags[256];
   struct    ConditionCodes cc;
   uint8_t   int_enable;
+  // Set by HLT, the CPU does nothing until it is cleared
+  uint8_t   halted;
+  // Set by UnimplementedInstruction, which also halts the CPU for good
+  uint8_t   fault;
+  // T-states run since reset
+  uint64_t  cycles;
+  // Timed events such as the video interrupts
+  Scheduler sched;
+  // One byte per 32-byte block of the address space, set by every write to
+  // it. For video RAM a block is exactly one column of the screen.
+  uint8_t   dirty[0x10000 >> 5];
+  // Decoded code for RunCached8080, NULL until it first runs
+  BlockCache *blocks;
+  // What IN and OUT talk to
+  const Ports *ports;
+  MidwayIO  io;
+  // Where writes to the sound ports go, NULL for nowhere
+  struct    SoundRing *sound;
+  // Free for the host's own callbacks
+  void      *user;
+  // Post-mortem trace, NULL unless --trace=ring
+  struct    TraceRing *trace;
+  // Counters for RunProfiled8080, NULL unless --profile
+  struct    Profile *profile;
+  // Breakpoints and watchpoints, NULL unless a debugger is attached
+  struct    Debugger *debug;
+  // The pool `memory` is a window of, NULL if it is the machine's own
+  struct    MemoryPool *pool;
+  // Set if `memory` came from MapMemory8080 rather than malloc
+  uint8_t   mapped;
 } State8080;
 
+// How much of the instruction stream gets recorded
+typedef enum TraceLevel {
+  TRACE_OFF,  // nothing, the dispatch loop has no hook at all
+  TRACE_RING, // last N instructions kept in memory, dumped on a fault
+  TRACE_FULL, // every instruction disassembled to stdout
+} TraceLevel;
+
+// One recorded instruction, kept in binary form so that recording it is just
+// a few stores. It only gets disassembled when the ring is dumped.
+typedef struct TraceEntry {
+  uint16_t  pc;
+  uint8_t   op[3];  // opcode and up to two operand bytes
+  uint8_t   a;
+  uint16_t  sp;
+} TraceEntry;
+
+typedef struct TraceRing {
+  TraceEntry *entries;
+  uint32_t   mask;  // size - 1, size is a power of two
+  uint32_t   count; // total instructions recorded, wraps around the ring
+} TraceRing;
+
+#define PROFILE_EDGES 4096  // call graph hash table slots, a power of two
+#define PROFILE_DEPTH 64    // calls followed, deeper ones are not
+
+typedef struct ProfileCounter {
+  uint64_t  count;
+  uint64_t  cycles;
+} ProfileCounter;
+
+// A call site and the routine it calls, with the cycles spent in the
+// routine (callees included) by the calls that returned to the site
+typedef struct ProfileEdge {
+  uint16_t  site;
+  uint16_t  target;
+  uint8_t   used;
+  uint64_t  calls;
+  uint64_t  cycles;
+} ProfileEdge;
+
+// A call that has not returned yet
+typedef struct ProfileFrame {
+  ProfileEdge *edge;
+  uint16_t  ret;    // where it will return to
+  uint64_t  start;  // cycle count when it was made
+} ProfileFrame;
+
+/**
+ * What RunProfiled8080 counts: instructions run and cycles spent at each
+ * guest address and for each opcode, and the calls between routines.
+ * While it runs, `cycles` only holds the extra cycles of taken conditional
+ * calls and returns; ProfileReport adds the rest. Interrupts count nowhere.
+ */
+typedef struct Profile {
+  ProfileCounter pc[0x10000];
+  ProfileCounter op[256];
+  ProfileEdge  edges[PROFILE_EDGES];
+  uint64_t     lost_edges;  // calls not counted because the table was full
+  ProfileFrame stack[PROFILE_DEPTH];
+  int          depth;
+} Profile;
+
+#define DEBUG_BREAKS  16
+#define DEBUG_WATCHES 16
+
+// Kinds of breakpoint, and the bits of Debugger.page
+#define DEBUG_EXEC  1
+#define DEBUG_READ  2
+#define DEBUG_WRITE 4
+
+// What a breakpoint's condition looks at
+typedef enum DebugReg {
+  REG_NONE,  // no condition, always stop
+  REG_A, REG_B, REG_C, REG_D, REG_E, REG_H, REG_L,
+  REG_BC, REG_DE, REG_HL, REG_SP,
+} DebugReg;
+
+typedef struct Breakpoint {
+  uint16_t  pc;
+  DebugReg  reg;
+  uint16_t  value;  // stop only if `reg` holds this
+} Breakpoint;
+
+typedef struct Watchpoint {
+  uint16_t  first;
+  uint16_t  last;   // inclusive
+  uint8_t   kind;   // DEBUG_READ, DEBUG_WRITE or both
+} Watchpoint;
+
+// Why a machine stopped
+typedef struct DebugHit {
+  uint8_t   kind;   // a DEBUG_ bit, 0 while it runs
+  uint16_t  pc;     // the instruction that hit
+  uint16_t  adr;    // for a watchpoint, the byte it read or wrote
+  uint8_t   value;  // and the value
+} DebugHit;
+
+/**
+ * The breakpoints and watchpoints of one machine, see RunDebug8080. `page`
+ * has the DEBUG_ bits of everything set on each 256-byte page, so that
+ * code elsewhere never looks at the lists.
+ */
+typedef struct Debugger {
+  Breakpoint breaks[DEBUG_BREAKS];
+  int        break_count;
+  Watchpoint watches[DEBUG_WATCHES];
+  int        watch_count;
+  uint8_t    page[256];
+  uint8_t    armed;   // DEBUG_ bits of everything set
+  DebugHit   hit;
+  // Run the next instruction without stopping at a breakpoint on it
+  uint8_t    skip;
+} Debugger;
+
 int Parity(int x) {
   return !__builtin_parity(x);
 }
 
+// Flag bits as they sit in the PSW byte pushed by PUSH PSW
+#define FLAG_S  0x80
+#define FLAG_Z  0x40
+#define FLAG_AC 0x10
+#define FLAG_P  0x04
+#define FLAG_CY 0x01
+
+/**
+ * Precomputed S, Z and P bits (in their PSW positions) for every result
+ * byte, so an ALU op can look its flags up instead of working them out.
+ *
+ * The first 256 entries are indexed by a result. The second 256 are indexed
+ * by 0x100 | PSW and just mask the PSW, which lets a flag byte popped by POP
+ * PSW be stored the same way as a result even when it holds a combination no
+ * result can produce, like Z and S both set.
+ */
+static const uint8_t ZSPTable[512] = {
+  0x44, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+  0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+  0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+  0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+  0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+  0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+  0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+  0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+  0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+  0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+  0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+  0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+  0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+  0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+  0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+  0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+  0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+  0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+  0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+  0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+  0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+  0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+  0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+  0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+  0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+  0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+  0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+  0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+  0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+  0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+  0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+  0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+  0x00, 0x00, 0x00, 0x00, 0x04, 0x04, 0x04, 0x04,
+  0x00, 0x00, 0x00, 0x00, 0x04, 0x04, 0x04, 0x04,
+  0x00, 0x00, 0x00, 0x00, 0x04, 0x04, 0x04, 0x04,
+  0x00, 0x00, 0x00, 0x00, 0x04, 0x04, 0x04, 0x04,
+  0x00, 0x00, 0x00, 0x00, 0x04, 0x04, 0x04, 0x04,
+  0x00, 0x00, 0x00, 0x00, 0x04, 0x04, 0x04, 0x04,
+  0x00, 0x00, 0x00, 0x00, 0x04, 0x04, 0x04, 0x04,
+  0x00, 0x00, 0x00, 0x00, 0x04, 0x04, 0x04, 0x04,
+  0x40, 0x40, 0x40, 0x40, 0x44, 0x44, 0x44, 0x44,
+  0x40, 0x40, 0x40, 0x40, 0x44, 0x44, 0x44, 0x44,
+  0x40, 0x40, 0x40, 0x40, 0x44, 0x44, 0x44, 0x44,
+  0x40, 0x40, 0x40, 0x40, 0x44, 0x44, 0x44, 0x44,
+  0x40, 0x40, 0x40, 0x40, 0x44, 0x44, 0x44, 0x44,
+  0x40, 0x40, 0x40, 0x40, 0x44, 0x44, 0x44, 0x44,
+  0x40, 0x40, 0x40, 0x40, 0x44, 0x44, 0x44, 0x44,
+  0x40, 0x40, 0x40, 0x40, 0x44, 0x44, 0x44, 0x44,
+  0x80, 0x80, 0x80, 0x80, 0x84, 0x84, 0x84, 0x84,
+  0x80, 0x80, 0x80, 0x80, 0x84, 0x84, 0x84, 0x84,
+  0x80, 0x80, 0x80, 0x80, 0x84, 0x84, 0x84, 0x84,
+  0x80, 0x80, 0x80, 0x80, 0x84, 0x84, 0x84, 0x84,
+  0x80, 0x80, 0x80, 0x80, 0x84, 0x84, 0x84, 0x84,
+  0x80, 0x80, 0x80, 0x80, 0x84, 0x84, 0x84, 0x84,
+  0x80, 0x80, 0x80, 0x80, 0x84, 0x84, 0x84, 0x84,
+  0x80, 0x80, 0x80, 0x80, 0x84, 0x84, 0x84, 0x84,
+  0xc0, 0xc0, 0xc0, 0xc0, 0xc4, 0xc4, 0xc4, 0xc4,
+  0xc0, 0xc0, 0xc0, 0xc0, 0xc4, 0xc4, 0xc4, 0xc4,
+  0xc0, 0xc0, 0xc0, 0xc0, 0xc4, 0xc4, 0xc4, 0xc4,
+  0xc0, 0xc0, 0xc0, 0xc0, 0xc4, 0xc4, 0xc4, 0xc4,
+  0xc0, 0xc0, 0xc0, 0xc0, 0xc4, 0xc4, 0xc4, 0xc4,
+  0xc0, 0xc0, 0xc0, 0xc0, 0xc4, 0xc4, 0xc4, 0xc4,
+  0xc0, 0xc0, 0xc0, 0xc0, 0xc4, 0xc4, 0xc4, 0xc4,
+  0xc0, 0xc0, 0xc0, 0xc0, 0xc4, 0xc4, 0xc4, 0xc4,
+};
+
+// Cycles (T-states) per opcode, from the 8080 data book. Conditional calls
+// and returns are listed with their not-taken count; taking one costs
+// another 6 (CALL 11/17, RET 5/11). Conditional jumps are 10 either way.
+static const uint8_t Cycles8080[256] = {
+   4, 10,  7,  5,  5,  5,  7,  4,  4, 10,  7,  5,  5,  5,  7,  4, // 00
+   4, 10,  7,  5,  5,  5,  7,  4,  4, 10,  7,  5,  5,  5,  7,  4, // 10
+   4, 10, 16,  5,  5,  5,  7,  4,  4, 10, 16,  5,  5,  5,  7,  4, // 20
+   4, 10, 13,  5, 10, 10, 10,  4,  4, 10, 13,  5,  5,  5,  7,  4, // 30
+   5,  5,  5,  5,  5,  5,  7,  5,  5,  5,  5,  5,  5,  5,  7,  5, // 40
+   5,  5,  5,  5,  5,  5,  7,  5,  5,  5,  5,  5,  5,  5,  7,  5, // 50
+   5,  5,  5,  5,  5,  5,  7,  5,  5,  5,  5,  5,  5,  5,  7,  5, // 60
+   7,  7,  7,  7,  7,  7,  7,  7,  5,  5,  5,  5,  5,  5,  7,  5, // 70
+   4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4, // 80
+   4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4, // 90
+   4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4, // a0
+   4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4, // b0
+   5, 10, 10, 10, 11, 11,  7, 11,  5, 10, 10, 10, 11, 17,  7, 11, // c0
+   5, 10, 10, 10, 11, 11,  7, 11,  5, 10, 10, 10, 11, 17,  7, 11, // d0
+   5, 10, 10, 18, 11, 11,  7, 11,  5,  5, 10,  4, 11, 17,  7, 11, // e0
+   5, 10, 10,  4, 11, 11,  7, 11,  5,  5, 10,  4, 11, 17,  7, 11, // f0
+};
+
+// Instruction length in bytes, opcode included. The undocumented aliases
+// are as long as what they alias: 0xcb is JMP and 0xdd/0xed/0xfd are CALL.
+static const uint8_t Length8080[256] = {
+  1, 3, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // 00
+  1, 3, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // 10
+  1, 3, 3, 1, 1, 1, 2, 1, 1, 1, 3, 1, 1, 1, 2, 1, // 20
+  1, 3, 3, 1, 1, 1, 2, 1, 1, 1, 3, 1, 1, 1, 2, 1, // 30
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 40
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 50
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 60
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 70
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 80
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 90
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // a0
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // b0
+  1, 1, 3, 3, 3, 1, 2, 1, 1, 1, 3, 3, 3, 3, 2, 1, // c0
+  1, 1, 3, 2, 3, 1, 2, 1, 1, 1, 3, 2, 3, 3, 2, 1, // d0
+  1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 3, 2, 1, // e0
+  1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 3, 2, 1, // f0
+};
+
+// Space Invaders runs the 8080 at 2 MHz and refreshes the screen at 60 Hz
+#define CPU_HZ            2000000
+#define FRAME_HZ          60
+#define HALF_FRAME_CYCLES (CPU_HZ / FRAME_HZ / 2)
+
+/*
+ * The cabinet only decodes 14 address lines: 8K of ROM at 0000-1FFF and 8K
+ * of RAM at 2000-3FFF (video RAM from 2400), repeated every 16K up to FFFF.
+ * Only the RAM differs from one machine to the next.
+ */
+#define ROM_SIZE    0x2000
+#define RAM_SIZE    0x2000
+#define MIRROR_SIZE (ROM_SIZE + RAM_SIZE)
+
+static inline void SetZSP(ConditionCodes *cc, uint8_t x) {
+  uint8_t f = ZSPTable[x];
+  cc->z = (f & FLAG_Z) != 0;
+  cc->s = (f & FLAG_S) != 0;
+  cc->p = (f & FLAG_P) != 0;
+}
+
+/**
+ * Lazily evaluated flags, used by the threaded engine. ALU ops only store
+ * what the flags are derived from: the result byte (or 0x100 | PSW after POP
+ * PSW) as an index into ZSPTable, and the xor of the operands and result,
+ * whose bit 4 is the auxiliary carry. The actual bits are only worked out
+ * when something reads them: a conditional jump, call or return, DAA, PUSH
+ * PSW, or the engine handing the flags back in State8080.cc. Most flag
+ * writes are overwritten before anything reads them. Carry is read by so many
+ * instructions (ADC, SBB, the rotates) that it is kept as a plain bit.
+ */
+typedef struct LazyFlags {
+  uint16_t  zsp;
+  uint8_t   aux;
+  uint8_t   cy;
+} LazyFlags;
+
+static inline uint8_t LazyFlagsPSW(LazyFlags f) {
+  return ZSPTable[f.zsp] | (f.aux & FLAG_AC) | 0x02 | f.cy;
+}
+
+static inline LazyFlags LazyFlagsFromPSW(uint8_t psw) {
+  LazyFlags f = { 0x100 | psw, psw, psw & FLAG_CY };
+  return f;
+}
+
+static inline LazyFlags LazyFlagsFromCC(ConditionCodes cc) {
+  return LazyFlagsFromPSW(cc.s << 7 | cc.z << 6 | cc.ac << 4 | cc.p << 2 |
+                          cc.cy);
+}
+
+static inline void LazyFlagsToCC(LazyFlags f, ConditionCodes *cc) {
+  uint8_t psw = LazyFlagsPSW(f);
+  cc->z = (psw & FLAG_Z) != 0;
+  cc->s = (psw & FLAG_S) != 0;
+  cc->p = (psw & FLAG_P) != 0;
+  cc->cy = psw & FLAG_CY;
+  cc->ac = (psw & FLAG_AC) != 0;
+}
+
+static void InvalidateCodePage(State8080 *state, uint8_t page);
+
+/**
+ * Stores a byte and marks its 32-byte block dirty. The mark is a plain store
+ * rather than a test of whether the address is video RAM, so it costs no
+ * branch. This is the host's store: it goes in even where the memory map
+ * would stop the CPU's, e.g. to load a ROM.
+ */
+static inline void WriteByte(State8080 *state, uint16_t adr, uint8_t value) {
+  state->memory[adr] = value;
+  state->dirty[adr >> 5] = 1;
+  if (state->page_flags[adr >> 8] & PAGE_CODE)
+    InvalidateCodePage(state, adr >> 8);
+}
+
+/**
+ * Checks a store the CPU made to a page flagged PAGE_WATCH against the
+ * write watchpoints, and records the first hit. Returns 1 on a hit.
+ */
+static int DebugStore(State8080 *state, uint16_t adr, uint8_t value,
+                      uint16_t pc) {
+  Debugger *debug = state->debug;
+  for (int i = 0; i < debug->watch_count; i++) {
+    const Watchpoint *w = &debug->watches[i];
+    if ((w->kind & DEBUG_WRITE) && adr >= w->first && adr <= w->last) {
+      if (debug->hit.kind == 0)
+        debug->hit = (DebugHit) { DEBUG_WRITE, pc, adr, value };
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// The slow path of a CPU store to a page with some page_flags bit set.
+// Returns 1 if it hit a write watchpoint.
+static int StoreSlowPath(State8080 *state, uint16_t adr, uint8_t value,
+                         uint16_t pc) {
+  uint8_t flags = state->page_flags[adr >> 8];
+  int hit = (flags & PAGE_WATCH) && DebugStore(state, adr, value, pc);
+  if (flags & PAGE_HANDLER)
+    state->map->write[adr >> 8](state, adr, value);
+  else
+    WriteByte(state, adr, value);
+  return hit;
+}
+
+/**
+ * A store by the CPU, as the engines make it: straight into memory, unless
+ * the page is flagged, e.g. ROM, which the memory map keeps the CPU from
+ * writing.
+ */
+static inline void StoreByte(State8080 *state, uint16_t adr, uint8_t value) {
+  if (state->page_flags[adr >> 8]) {
+    StoreSlowPath(state, adr, value, state->pc);
+  } else {
+    state->memory[adr] = value;
+    state->dirty[adr >> 5] = 1;
+  }
+}
+
+/**
+ * What the disassembler prints for each opcode. The operand, if
+ * Length8080 says there is one, follows in hex: a byte for length 2, the
+ * word for length 3. The undocumented opcodes show as what they alias.
+ */
+static const char *const Mnemonics8080[256] = {
+  "NOP",          "LXI    B,#$",  "STAX   B",     "INX    B",         // 00
+  "INR    B",     "DCR    B",     "MVI    B,#$",  "RLC",
+  "NOP",          "DAD    B",     "LDAX   B",     "DCX    B",
+  "INR    C",     "DCR    C",     "MVI    C,#$",  "RRC",
+  "NOP",          "LXI    D,#$",  "STAX   D",     "INX    D",         // 10
+  "INR    D",     "DCR    D",     "MVI    D,#$",  "RAL",
+  "NOP",          "DAD    D",     "LDAX   D",     "DCX    D",
+  "INR    E",     "DCR    E",     "MVI    E,#$",  "RAR",
+  "NOP",          "LXI    H,#$",  "SHLD   $",     "INX    H",         // 20
+  "INR    H",     "DCR    H",     "MVI    H,#$",  "DAA",
+  "NOP",          "DAD    H",     "LHLD   $",     "DCX    H",
+  "INR    L",     "DCR    L",     "MVI    L,#$",  "CMA",
+  "NOP",          "LXI    SP,#$", "STA    $",     "INX    SP",        // 30
+  "INR    M",     "DCR    M",     "MVI    M,#$",  "STC",
+  "NOP",          "DAD    SP",    "LDA    $",     "DCX    SP",
+  "INR    A",     "DCR    A",     "MVI    A,#$",  "CMC",
+  "MOV    B,B",   "MOV    B,C",   "MOV    B,D",   "MOV    B,E",       // 40
+  "MOV    B,H",   "MOV    B,L",   "MOV    B,M",   "MOV    B,A",
+  "MOV    C,B",   "MOV    C,C",   "MOV    C,D",   "MOV    C,E",
+  "MOV    C,H",   "MOV    C,L",   "MOV    C,M",   "MOV    C,A",
+  "MOV    D,B",   "MOV    D,C",   "MOV    D,D",   "MOV    D,E",       // 50
+  "MOV    D,H",   "MOV    D,L",   "MOV    D,M",   "MOV    D,A",
+  "MOV    E,B",   "MOV    E,C",   "MOV    E,D",   "MOV    E,E",
+  "MOV    E,H",   "MOV    E,L",   "MOV    E,M",   "MOV    E,A",
+  "MOV    H,B",   "MOV    H,C",   "MOV    H,D",   "MOV    H,E",       // 60
+  "MOV    H,H",   "MOV    H,L",   "MOV    H,M",   "MOV    H,A",
+  "MOV    L,B",   "MOV    L,C",   "MOV    L,D",   "MOV    L,E",
+  "MOV    L,H",   "MOV    L,L",   "MOV    L,M",   "MOV    L,A",
+  "MOV    M,B",   "MOV    M,C",   "MOV    M,D",   "MOV    M,E",       // 70
+  "MOV    M,H",   "MOV    M,L",   "HLT",          "MOV    M,A",
+  "MOV    A,B",   "MOV    A,C",   "MOV    A,D",   "MOV    A,E",
+  "MOV    A,H",   "MOV    A,L",   "MOV    A,M",   "MOV    A,A",
+  "ADD    B",     "ADD    C",     "ADD    D",     "ADD    E",         // 80
+  "ADD    H",     "ADD    L",     "ADD    M",     "ADD    A",
+  "ADC    B",     "ADC    C",     "ADC    D",     "ADC    E",
+  "ADC    H",     "ADC    L",     "ADC    M",     "ADC    A",
+  "SUB    B",     "SUB    C",     "SUB    D",     "SUB    E",         // 90
+  "SUB    H",     "SUB    L",     "SUB    M",     "SUB    A",
+  "SBB    B",     "SBB    C",     "SBB    D",     "SBB    E",
+  "SBB    H",     "SBB    L",     "SBB    M",     "SBB    A",
+  "ANA    B",     "ANA    C",     "ANA    D",     "ANA    E",         // a0
+  "ANA    H",     "ANA    L",     "ANA    M",     "ANA    A",
+  "XRA    B",     "XRA    C",     "XRA    D",     "XRA    E",
+  "XRA    H",     "XRA    L",     "XRA    M",     "XRA    A",
+  "ORA    B",     "ORA    C",     "ORA    D",     "ORA    E",         // b0
+  "ORA    H",     "ORA    L",     "ORA    M",     "ORA    A",
+  "CMP    B",     "CMP    C",     "CMP    D",     "CMP    E",
+  "CMP    H",     "CMP    L",     "CMP    M",     "CMP    A",
+  "RNZ",          "POP    B",     "JNZ    $",     "JMP    $",         // c0
+  "CNZ    $",     "PUSH   B",     "ADI    $#",    "RST    0",
+  "RZ",           "RET",          "JZ     $",     "JMP    $",
+  "CZ     $",     "CALL   $",     "ACI    $#",    "RST    1",
+  "RNC",          "POP    D",     "JNC    $",     "OUT    $#",        // d0
+  "CNC    $",     "PUSH   D",     "SUI    $#",    "RST    2",
+  "RC",           "RET",          "JC     $",     "IN     $#",
+  "CC     $",     "CALL   $",     "SBI    $#",    "RST    3",
+  "RPO",          "POP    H",     "JPO    $",     "XTHL",             // e0
+  "CPO    $",     "PUSH   H",     "ANI    $#",    "RST    4",
+  "RPE",          "PCHL",         "JPE    $",     "XCHG",
+  "CPE    $",     "CALL   $",     "XRI    $#",    "RST    5",
+  "RP",           "POP    PSW",   "JP     $",     "DI",               // f0
+  "CP     $",     "PUSH   PSW",   "ORI    $#",    "RST    6",
+  "RM",           "SPHL",         "JM     $",     "EI",
+  "CM     $",     "CALL   $",     "CPI    $#",    "RST    7",
+};
+
+// Longest line Format8080 writes, the terminating NUL included
+#define DISASSEMBLY_SIZE 24
+
+/**
+ * Writes the instruction at `code` as one line of text to `out`, which
+ * must have room for DISASSEMBLY_SIZE bytes: the address `pc`, then the
+ * mnemonic and operand, with no newline. Returns the instruction length.
+ * It touches no stdio, so it is cheap enough to run over a whole ROM.
+ */
+int Format8080(char *out, const uint8_t *code, int pc) {
+  static const char hex[] = "0123456789abcdef";
+  int len = Length8080[*code];
+  char *p = out;
+  for (int shift = 12; shift >= 0; shift -= 4)
+    *p++ = hex[pc >> shift & 0xf];
+  *p++ = ' ';
+  for (const char *m = Mnemonics8080[*code]; *m != '\0'; m++)
+    *p++ = *m;
+  // $ means hex, # is a literal number
+  for (int i = len - 1; i > 0; i--) {
+    *p++ = hex[code[i] >> 4];
+    *p++ = hex[code[i] & 0xf];
+  }
+  *p = '\0';
+  return len;
+}
+
+/**
+ * unsigned char *code - the opcode followed by its operand bytes
+ * int pc - the address to print for the opcode
+ */
+int Disassemble8080Bytes(const unsigned char *code, int pc) {
+  char line[DISASSEMBLY_SIZE];
+  int opbytes = Format8080(line, code, pc);
+  puts(line);
+  return opbytes;
+}
+
 /**
  * unsigned char *codebuffer - this is just a pointer to a string
  * int pc - index into the string
  */
 int Disassemble8080Op(unsigned char *codebuffer, int pc) {
-  unsigned char *code = &codebuffer[pc];
-  int opbytes = 1;
-  // x for lowercase hex
-  // 04 for 4 width, left padded with 0
-  printf("%04x ", pc);
-  // $ means hex
-  // # is a literal number
-  switch (*code) {
-  case 0x00: printf("NOP"); break;
-  case 0x01: printf("LXI    B,#$%02x%02x", code[2], code[1]); opbytes = 3; break;
-  case 0x02: printf("STAX   B"); break;
-  case 0x03: printf("INX    B"); break;
-  case 0x04: printf("INR    B"); break;
-  case 0x05: printf("DCR    B"); break;
-  case 0x06: printf("MVI    B,#$%02x", code[1]); opbytes = 2; break;
-  case 0x07: printf("RLC"); break;
-  case 0x08: printf("NOP"); break;
-  case 0x09: printf("DAD    B"); break;
-  case 0x0a: printf("LDAX   B"); break;
-  case 0x0b: printf("DCX    B"); break;
-  case 0x0c: printf("INR    C"); break;
-  case 0x0d: printf("DCR    C"); break;
-  case 0x0e: printf("MVI    C,#$%02x", code[1]); opbytes = 2; break;
-  case 0x0f: printf("RRC"); break;
-  case 0x10: printf("NOP"); break;
-  case 0x11: printf("LXI    D,#$%02x%02x", code[2], code[1]); opbytes = 3; break;
-  case 0x12: printf("STAX   D"); break;
-  case 0x13: printf("INX    D"); break;
-  case 0x14: printf("INR    D"); break;
-  case 0x15: printf("DCR    D"); break;
-  case 0x16: printf("MVI    D,#$%02x", code[1]); opbytes = 2; break;
-  case 0x17: printf("RAL"); break;
-  case 0x18: printf("NOP"); break;
-  case 0x19: printf("DAD    D"); break;
-  case 0x1a: printf("LDAX   D"); break;
-  case 0x1b: printf("DCX    D"); break;
-  case 0x1c: printf("INR    E"); break;
-  case 0x1d: printf("DCR    E"); break;
-  case 0x1e: printf("MVI    E,#$%02x", code[1]); opbytes = 2; break;
-  case 0x1f: printf("RAR"); break;
-  case 0x20: printf("RIM"); break;
-  case 0x21: printf("LXI    H,#$%02x%02x", code[2], code[1]); opbytes = 3; break;
-  case 0x22: printf("SHLD   $%02x%02x", code[2], code[1]); opbytes = 3; break;
-  case 0x23: printf("INX    H"); break;
-  case 0x24: printf("INR    H"); break;
-  case 0x25: printf("DCR    H"); break;
-  case 0x26: printf("MVI    H,#$%02x", code[1]); opbytes = 2; break;
-  case 0x27: printf("DAA"); break;
-  case 0x28: printf("NOP"); break;
-  case 0x29: printf("DAD    H"); break;
-  case 0x2a: printf("LHLD   $%02x%02x", code[2], code[1]); opbytes = 3; break;
-  case 0x2b: printf("DCX    H"); break;
-  case 0x2c: printf("INR    L"); break;
-  case 0x2d: printf("DCR    L"); break;
-  case 0x2e: printf("MVI    L,#$%02x", code[1]); opbytes = 2; break;
-  case 0x2f: printf("CMA"); break;
-  case 0x30: printf("SIM"); break;
-  case 0x31: printf("LXI    SP,#$%02x%02x", code[2], code[1]); opbytes = 3; break;
-  case 0x32: printf("STA    $%02x%02x", code[2], code[1]); opbytes = 3; break;
-  case 0x33: printf("INX    SP"); break;
-  case 0x34: printf("INR    M"); break;
-  case 0x35: printf("DCR    M"); break;
-  case 0x36: printf("MVI    M,#$%02x", code[1]); opbytes = 2; break;
-  case 0x37: printf("STC"); break;
-  case 0x38: printf("NOP"); break;
-  case 0x39: printf("DAD    SP"); break;
-  case 0x3a: printf("LDA    $%02x%02x", code[2], code[1]); opbytes = 3; break;
-  case 0x3b: printf("DCX    SP"); break;
-  case 0x3c: printf("INR    A"); break;
-  case 0x3d: printf("DCR    A"); break;
-  case 0x3e: printf("MVI    A,#$%02x", code[1]); opbytes = 2; break;
-  case 0x3f: printf("CMC"); break;
-  case 0x40: printf("MOV    B,B"); break;
-  case 0x41: printf("MOV    B,C"); break;
-  case 0x42: printf("MOV    B,D"); break;
-  case 0x43: printf("MOV    B,E"); break;
-  case 0x44: printf("MOV    B,H"); break;
-  case 0x45: printf("MOV    B,L"); break;
-  case 0x46: printf("MOV    B,M"); break;
-  case 0x47: printf("MOV    B,A"); break;
-  case 0x48: printf("MOV    C,B"); break;
-  case 0x49: printf("MOV    C,C"); break;
-  case 0x4a: printf("MOV    C,D"); break;
-  case 0x4b: printf("MOV    C,E"); break;
-  case 0x4c: printf("MOV    C,H"); break;
-  case 0x4d: printf("MOV    C,L"); break;
-  case 0x4e: printf("MOV    C,M"); break;
-  case 0x4f: printf("MOV    C,A"); break;
-  case 0x50: printf("MOV    D,B"); break;
-  case 0x51: printf("MOV    D,C"); break;
-  case 0x52: printf("MOV    D,D"); break;
-  case 0x53: printf("MOV    D,E"); break;
-  case 0x54: printf("MOV    D,H"); break;
-  case 0x55: printf("MOV    D,L"); break;
-  case 0x56: printf("MOV    D,M"); break;
-  case 0x57: printf("MOV    D,A"); break;
-  case 0x58: printf("MOV    E,B"); break;
-  case 0x59: printf("MOV    E,C"); break;
-  case 0x5a: printf("MOV    E,D"); break;
-  case 0x5b: printf("MOV    E,E"); break;
-  case 0x5c: printf("MOV    E,H"); break;
-  case 0x5d: printf("MOV    E,L"); break;
-  case 0x5e: printf("MOV    E,M"); break;
-  case 0x5f: printf("MOV    E,A"); break;
-  case 0x60: printf("MOV    H,B"); break;
-  case 0x61: printf("MOV    H,C"); break;
-  case 0x62: printf("MOV    H,D"); break;
-  case 0x63: printf("MOV    H,E"); break;
-  case 0x64: printf("MOV    H,H"); break;
-  case 0x65: printf("MOV    H,L"); break;
-  case 0x66: printf("MOV    H,M"); break;
-  case 0x67: printf("MOV    H,A"); break;
-  case 0x68: printf("MOV    L,B"); break;
-  case 0x69: printf("MOV    L,C"); break;
-  case 0x6a: printf("MOV    L,D"); break;
-  case 0x6b: printf("MOV    L,E"); break;
-  case 0x6c: printf("MOV    L,H"); break;
-  case 0x6d: printf("MOV    L,L"); break;
-  case 0x6e: printf("MOV    L,M"); break;
-  case 0x6f: printf("MOV    L,A"); break;
-  case 0x70: printf("MOV    M,B"); break;
-  case 0x71: printf("MOV    M,C"); break;
-  case 0x72: printf("MOV    M,D"); break;
-  case 0x73: printf("MOV    M,E"); break;
-  case 0x74: printf("MOV    M,H"); break;
-  case 0x75: printf("MOV    M,L"); break;
-  case 0x76: printf("HLT"); break;
-  case 0x77: printf("MOV    M,A"); break;
-  case 0x78: printf("MOV    A,B"); break;
-  case 0x79: printf("MOV    A,C"); break;
-  case 0x7a: printf("MOV    A,D"); break;
-  case 0x7b: printf("MOV    A,E"); break;
-  case 0x7c: printf("MOV    A,H"); break;
-  case 0x7d: printf("MOV    A,L"); break;
-  case 0x7e: printf("MOV    A,M"); break;
-  case 0x7f: printf("MOV    A,A"); break;
-  case 0x80: printf("ADD    B"); break;
-  case 0x81: printf("ADD    C"); break;
-  case 0x82: printf("ADD    D"); break;
-  case 0x83: printf("ADD    E"); break;
-  case 0x84: printf("ADD    H"); break;
-  case 0x85: printf("ADD    L"); break;
-  case 0x86: printf("ADD    M"); break;
-  case 0x87: printf("ADD    A"); break;
-  case 0x88: printf("ADC    B"); break;
-  case 0x89: printf("ADC    C"); break;
-  case 0x8a: printf("ADC    D"); break;
-  case 0x8b: printf("ADC    E"); break;
-  case 0x8c: printf("ADC    H"); break;
-  case 0x8d: printf("ADC    L"); break;
-  case 0x8e: printf("ADC    M"); break;
-  case 0x8f: printf("ADC    A"); break;
-  case 0x90: printf("SUB    B"); break;
-  case 0x91: printf("SUB    C"); break;
-  case 0x92: printf("SUB    D"); break;
-  case 0x93: printf("SUB    E"); break;
-  case 0x94: printf("SUB    H"); break;
-  case 0x95: printf("SUB    L"); break;
-  case 0x96: printf("SUB    M"); break;
-  case 0x97: printf("SUB    A"); break;
-  case 0x98: printf("SBB    B"); break;
-  case 0x99: printf("SBB    C"); break;
-  case 0x9a: printf("SBB    D"); break;
-  case 0x9b: printf("SBB    E"); break;
-  case 0x9c: printf("SBB    H"); break;
-  case 0x9d: printf("SBB    L"); break;
-  case 0x9e: printf("SBB    M"); break;
-  case 0x9f: printf("SBB    A"); break;
-  case 0xa0: printf("ANA    B"); break;
-  case 0xa1: printf("ANA    C"); break;
-  case 0xa2: printf("ANA    D"); break;
-  case 0xa3: printf("ANA    E"); break;
-  case 0xa4: printf("ANA    H"); break;
-  case 0xa5: printf("ANA    L"); break;
-  case 0xa6: printf("ANA    M"); break;
-  case 0xa7: printf("ANA    A"); break;
-  case 0xa8: printf("XRA    B"); break;
-  case 0xa9: printf("XRA    C"); break;
-  case 0xaa: printf("XRA    D"); break;
-  case 0xab: printf("XRA    E"); break;
-  case 0xac: printf("XRA    H"); break;
-  case 0xad: printf("XRA    L"); break;
-  case 0xae: printf("XRA    M"); break;
-  case 0xaf: printf("XRA    A"); break;
-  case 0xb0: printf("ORA    B"); break;
-  case 0xb1: printf("ORA    C"); break;
-  case 0xb2: printf("ORA    D"); break;
-  case 0xb3: printf("ORA    E"); break;
-  case 0xb4: printf("ORA    H"); break;
-  case 0xb5: printf("ORA    L"); break;
-  case 0xb6: printf("ORA    M"); break;
-  case 0xb7: printf("ORA    A"); break;
-  case 0xb8: printf("CMP    B"); break;
-  case 0xb9: printf("CMP    C"); break;
-  case 0xba: printf("CMP    D"); break;
-  case 0xbb: printf("CMP    E"); break;
-  case 0xbc: printf("CMP    H"); break;
-  case 0xbd: printf("CMP    L"); break;
-  case 0xbe: printf("CMP    M"); break;
-  case 0xbf: printf("CMP    A"); break;
-  case 0xc0: printf("RNZ"); break;
-  case 0xc1: printf("POP    B"); break;
-  case 0xc2: printf("JNZ    $%02x%02x", code[2], code[1]); opbytes = 3; break;
-  case 0xc3: printf("JMP    $%02x%02x", code[2], code[1]); opbytes = 3; break;
-  case 0xc4: printf("CNZ    $%02x%02x", code[2], code[1]); opbytes = 3; break;
-  case 0xc5: printf("PUSH   B"); break;
-  case 0xc6: printf("ADI    $#%02x", code[1]); opbytes = 2; break;
-  case 0xc7: printf("RST    0"); break;
-  case 0xc8: printf("RZ"); break;
-  case 0xc9: printf("RET"); break;
-  case 0xca: printf("JZ     $%02x%02x", code[2], code[1]); opbytes = 3; break;
-  case 0xcb: printf("NOP"); break;
-  case 0xcc: printf("CZ     $%02x%02x", code[2], code[1]); opbytes = 3; break;
-  case 0xcd: printf("CALL   $%02x%02x", code[2], code[1]); opbytes = 3; break;
-  case 0xce: printf("ACI    $#%02x", code[1]); opbytes = 2; break;
-  case 0xcf: printf("RST    1"); break;
-  case 0xd0: printf("RNC"); break;
-  case 0xd1: printf("POP    D"); break;
-  case 0xd2: printf("JNC    $%02x%02x", code[2], code[1]); opbytes = 3; break;
-  case 0xd3: printf("OUT    $#%02x", code[1]); opbytes = 2; break;
-  case 0xd4: printf("CNC    $%02x%02x", code[2], code[1]); opbytes = 3; break;
-  case 0xd5: printf("PUSH   D"); break;
-  case 0xd6: printf("SUI    $#%02x", code[1]); opbytes = 2; break;
-  case 0xd7: printf("RST    2"); break;
-  case 0xd8: printf("RC"); break;
-  case 0xd9: printf("NOP"); break;
-  case 0xda: printf("JC     $%02x%02x", code[2], code[1]); opbytes = 3; break;
-  case 0xdb: printf("IN     $#%02x", code[1]); opbytes = 2; break;
-  case 0xdc: printf("CC     $%02x%02x", code[2], code[1]); opbytes = 3; break;
-  case 0xdd: printf("NOP"); break;
-  case 0xde: printf("SBI    $#%02x", code[1]); opbytes = 2; break;
-  case 0xdf: printf("RST    2"); break;
-  case 0xe0: printf("RPO"); break;
-  case 0xe1: printf("POP    H"); break;
-  case 0xe2: printf("JPO    $%02x%02x", code[2], code[1]); opbytes = 3; break;
-  case 0xe3: printf("XTHL"); break;
-  case 0xe4: printf("CPO    $%02x%02x", code[2], code[1]); opbytes = 3; break;
-  case 0xe5: printf("PUSH   H"); break;
-  case 0xe6: printf("ANI    $#%02x", code[1]); opbytes = 2; break;
-  case 0xe7: printf("RST    4"); break;
-  case 0xe8: printf("RPE"); break;
-  case 0xe9: printf("PCHL"); break;
-  case 0xea: printf("JPE    $%02x%02x", code[2], code[1]); opbytes = 3; break;
-  case 0xeb: printf("XCHG"); break;
-  case 0xec: printf("CPE    $%02x%02x", code[2], code[1]); opbytes = 3; break;
-  case 0xed: printf("NOP"); break;
-  case 0xee: printf("XRI    $#%02x", code[1]); opbytes = 2; break;
-  case 0xef: printf("RST    5"); break;
-  case 0xf0: printf("RP"); break;
-  case 0xf1: printf("POP    PSW"); break;
-  case 0xf2: printf("JP     $%02x%02x", code[2], code[1]); opbytes = 3; break;
-  case 0xf3: printf("DI"); break;
-  case 0xf4: printf("CP     $%02x%02x", code[2], code[1]); opbytes = 3; break;
-  case 0xf5: printf("PUSH   PSW"); break;
-  case 0xf6: printf("ORI    $#%02x", code[1]); opbytes = 2; break;
-  case 0xf7: printf("RST    6"); break;
-  case 0xf8: printf("RM"); break;
-  case 0xf9: printf("SPHL"); break;
-  case 0xfa: printf("JM     $%02x%02x", code[2], code[1]); opbytes = 3; break;
-  case 0xfb: printf("EI"); break;
-  case 0xfc: printf("CM     $%02x%02x", code[2], code[1]); opbytes = 3; break;
-  case 0xfd: printf("NOP"); break;
-  case 0xfe: printf("CPI    $#%02x", code[1]); opbytes = 2; break;
-  case 0xff: printf("RST    7"); break;
-  default:   printf("???"); break;
+  return Disassemble8080Bytes(&codebuffer[pc], pc);
+}
+
+// What AnalyzeCode8080 found a byte to be
+enum { BYTE_DATA, BYTE_OPCODE, BYTE_OPERAND };
+
+/**
+ * Sorts the first `size` bytes of `memory`, a ROM, into code and data by
+ * following every path from reset and the RST vectors: past calls,
+ * conditional branches and HLT, to the targets of jumps, calls and RSTs,
+ * and not past JMP, RET or PCHL. Fills `kind` with a BYTE_ value per byte
+ * and returns the number of instructions found. Code only reached through
+ * PCHL, or from RAM, is not found and shows as data.
+ */
+int AnalyzeCode8080(const uint8_t *memory, int size, uint8_t *kind) {
+  // Each instruction queues at most one target, plus the 8 vectors
+  uint16_t *todo = malloc((size + 8) * sizeof(uint16_t));
+  int top = 0, count = 0;
+  memset(kind, BYTE_DATA, size);
+  for (int vector = 0; vector < 0x40; vector += 8)
+    todo[top++] = vector;
+  while (top > 0) {
+    int pc = todo[--top];
+    while (pc < size && kind[pc] == BYTE_DATA) {
+      uint8_t op = memory[pc];
+      int len = Length8080[op];
+      if (pc + len > size)
+        break;
+      kind[pc] = BYTE_OPCODE;
+      for (int i = 1; i < len; i++)
+        kind[pc + i] = BYTE_OPERAND;
+      count++;
+      int target = -1;
+      // JMP, CALL, Jcc and Ccc, with the undocumented aliases
+      if (len == 3 && op >= 0xc0)
+        target = memory[pc + 1] | memory[pc + 2] << 8;
+      else if ((op & 0xc7) == 0xc7)
+        target = op & 0x38;
+      if (target >= 0 && target < size && kind[target] == BYTE_DATA)
+        todo[top++] = target;
+      if (op == 0xc3 || op == 0xcb || op == 0xc9 || op == 0xd9 || op == 0xe9)
+        break;
+      pc += len;
+    }
   }
+  free(todo);
+  return count;
+}
 
-  printf("\n");
-  return opbytes;
+/**
+ * Writes the first `size` bytes of `memory` to `out` as a listing, one line
+ * per instruction where `kind` (from AnalyzeCode8080) says code, and DB
+ * lines of up to 8 bytes where it says data. `out` needs room for
+ * size * DISASSEMBLY_SIZE + 1 bytes. Returns the length of the text.
+ */
+size_t ListCode8080(char *out, const uint8_t *memory, int size,
+                    const uint8_t *kind) {
+  static const char hex[] = "0123456789abcdef";
+  char *p = out;
+  for (int pc = 0; pc < size; ) {
+    if (kind[pc] == BYTE_OPCODE) {
+      int len = Format8080(p, &memory[pc], pc);
+      p += strlen(p);
+      *p++ = '\n';
+      pc += len;
+      continue;
+    }
+    for (int shift = 12; shift >= 0; shift -= 4)
+      *p++ = hex[pc >> shift & 0xf];
+    memcpy(p, " DB     ", 8);
+    p += 8;
+    for (int i = 0; i < 8 && pc < size && kind[pc] != BYTE_OPCODE; i++, pc++) {
+      if (i > 0)
+        *p++ = ',';
+      *p++ = '$';
+      *p++ = hex[memory[pc] >> 4];
+      *p++ = hex[memory[pc] & 0xf];
+    }
+    *p++ = '\n';
+  }
+  *p = '\0';
+  return p - out;
+}
+
+/**
+ * Allocates a ring holding the last `depth` instructions, rounded up to a
+ * power of two so that the write index is just a mask.
+ */
+TraceRing* TraceRingNew(uint32_t depth) {
+  uint32_t size = 1;
+  while (size < depth)
+    size <<= 1;
+  TraceRing *ring = calloc(1, sizeof(TraceRing));
+  ring->entries = calloc(size, sizeof(TraceEntry));
+  ring->mask = size - 1;
+  return ring;
+}
+
+void TraceRingFree(TraceRing *ring) {
+  if (ring == NULL)
+    return;
+  free(ring->entries);
+  free(ring);
+}
+
+/**
+ * Records the instruction at pc before it runs. Only called from the
+ * TRACE_RING loop in main, never from inside Emulate8080Op.
+ */
+static inline void TraceRecord(TraceRing *ring, State8080 *state) {
+  TraceEntry *e = &ring->entries[ring->count++ & ring->mask];
+  uint16_t pc = state->pc;
+  e->pc = pc;
+  e->op[0] = state->memory[pc];
+  e->op[1] = state->memory[(uint16_t) (pc + 1)];
+  e->op[2] = state->memory[(uint16_t) (pc + 2)];
+  e->a = state->a;
+  e->sp = state->sp;
+}
+
+/**
+ * Prints the recorded instructions oldest first. The last line is the
+ * instruction that was executing when the fault happened.
+ */
+void TraceRingDump(TraceRing *ring) {
+  uint32_t size = ring->mask + 1;
+  uint32_t n = ring->count < size ? ring->count : size;
+  printf("Last %u instructions:\n", n);
+  for (uint32_t i = ring->count - n; i != ring->count; i++) {
+    TraceEntry *e = &ring->entries[i & ring->mask];
+    char line[DISASSEMBLY_SIZE];
+    Format8080(line, e->op, e->pc);
+    printf("  A $%02x SP %04x  %s\n", e->a, e->sp, line);
+  }
+}
+
+typedef struct ProfileRow {
+  uint32_t  key;    // address, opcode, or index into Profile.edges
+  uint64_t  count;
+  uint64_t  cycles;
+} ProfileRow;
+
+// Most cycles first, then lowest key
+static int CompareProfileRows(const void *x, const void *y) {
+  const ProfileRow *a = x, *b = y;
+  if (a->cycles != b->cycles)
+    return a->cycles < b->cycles ? 1 : -1;
+  return a->key < b->key ? -1 : a->key > b->key;
+}
+
+/**
+ * Prints the `top` hottest addresses, opcodes and calls of a profile, most
+ * cycles first, each with the instruction at that address in `memory`. An
+ * opcode is shown by the address where it ran most. An address is charged
+ * for the instruction there now, which only matters for code in RAM that
+ * was rewritten.
+ */
+void ProfileReport(const Profile *prof, const uint8_t *memory, int top) {
+  ProfileRow *rows = malloc(0x10000 * sizeof(ProfileRow));
+  uint16_t hottest[256] = { 0 };
+  char line[DISASSEMBLY_SIZE];
+  uint64_t instructions = 0, cycles = 0;
+  int n = 0;
+  for (uint32_t pc = 0; pc < 0x10000; pc++) {
+    const ProfileCounter *c = &prof->pc[pc];
+    if (c->count == 0)
+      continue;
+    uint64_t spent = c->count * Cycles8080[memory[pc]] + c->cycles;
+    rows[n++] = (ProfileRow) { pc, c->count, spent };
+    instructions += c->count;
+    cycles += spent;
+    if (c->count > prof->pc[hottest[memory[pc]]].count)
+      hottest[memory[pc]] = pc;
+  }
+  if (cycles == 0)
+    cycles = 1;
+  printf("Profile: %llu instructions, %llu cycles at %d addresses\n",
+         (unsigned long long) instructions, (unsigned long long) cycles, n);
+
+  qsort(rows, n, sizeof(ProfileRow), CompareProfileRows);
+  printf("\nHottest addresses:\n   cycles         count  instruction\n");
+  for (int i = 0; i < n && i < top; i++) {
+    Format8080(line, &memory[rows[i].key], rows[i].key);
+    printf("%6.2f%% %12llu  %s\n", 100.0 * rows[i].cycles / cycles,
+           (unsigned long long) rows[i].count, line);
+  }
+
+  n = 0;
+  for (int op = 0; op < 256; op++)
+    if (prof->op[op].count != 0)
+      rows[n++] = (ProfileRow) { op, prof->op[op].count, prof->op[op].count *
+                                 Cycles8080[op] + prof->op[op].cycles };
+  qsort(rows, n, sizeof(ProfileRow), CompareProfileRows);
+  printf("\nHottest opcodes:\n   cycles         count  op  e.g.\n");
+  for (int i = 0; i < n && i < top; i++) {
+    uint16_t pc = hottest[rows[i].key];
+    Format8080(line, &memory[pc], pc);
+    printf("%6.2f%% %12llu  %02x  %s\n", 100.0 * rows[i].cycles / cycles,
+           (unsigned long long) rows[i].count, rows[i].key, line);
+  }
+
+  n = 0;
+  for (int i = 0; i < PROFILE_EDGES; i++)
+    if (prof->edges[i].used)
+      rows[n++] = (ProfileRow) { i, prof->edges[i].calls,
+                                 prof->edges[i].cycles };
+  qsort(rows, n, sizeof(ProfileRow), CompareProfileRows);
+  printf("\nHottest calls, cycles including callees:\n"
+         "   cycles         calls  site\n");
+  for (int i = 0; i < n && i < top; i++) {
+    uint16_t site = prof->edges[rows[i].key].site;
+    Format8080(line, &memory[site], site);
+    printf("%6.2f%% %12llu  %s\n", 100.0 * rows[i].cycles / cycles,
+           (unsigned long long) rows[i].count, line);
+  }
+  if (prof->lost_edges > 0)
+    printf("(%llu calls not counted, too many call sites)\n",
+           (unsigned long long) prof->lost_edges);
+  free(rows);
 }
 
 void UnimplementedInstruction(State8080* state) {
   // pc will have advanced one, so undo that
   printf("Error: Unimplemented instruction\n");
   state->pc--;
-  Disassemble8080Op(state->memory, state->pc);
+  if (state->trace != NULL)
+    TraceRingDump(state->trace);
+  else
+    Disassemble8080Op(state->memory, state->pc);
   printf("\n");
-  exit(1);
+  // Stop just this machine: halted with interrupts off it never wakes up
+  // again, while any others in the process carry on
+  state->halted = 1;
+  state->int_enable = 0;
+  state->fault = 1;
 }
 
 int Emulate8080Op(State8080* state) {
   unsigned char *opcode = &state->memory[state->pc];
-  Disassemble8080Op(state->memory, state->pc);
+  state->cycles += Cycles8080[*opcode];
   state->pc += 1;
   switch(*opcode) {
   case 0x00:
@@ -346,9 +948,7 @@ int Emulate8080Op(State8080* state) {
     // DCR B
     // B <- B - 1
     state->b--;
-    state->cc.z = state->b == 0;
-    state->cc.s = 0x80 == (state->b & 0x80);
-    state->cc.p = Parity(state->b);
+    SetZSP(&state->cc, state->b);
     break;
   case 0x06:
     // MVI B, D8
@@ -372,9 +972,7 @@ int Emulate8080Op(State8080* state) {
     // DCR C
     // C <- C - 1
     state->c--;
-    state->cc.z = state->c == 0;
-    state->cc.s = 0x80 == (state->c & 0x80);
-    state->cc.p = Parity(state->c);
+    SetZSP(&state->cc, state->c);
     break;
   case 0x0e:
     // MVI C, D8
@@ -482,7 +1080,7 @@ int Emulate8080Op(State8080* state) {
     // (adr) <- A
     {
       uint16_t offset = (opcode[2] << 8) | opcode[1];
-      state->memory[offset] = state->a;
+      StoreByte(state, offset, state->a);
       state->pc += 2;
     }
     break;
@@ -491,7 +1089,7 @@ int Emulate8080Op(State8080* state) {
     // (HL) <- byte 2
     {
       uint16_t offset = (state->h << 8) | state->l;
-      state->memory[offset] = opcode[1];
+      StoreByte(state, offset, opcode[1]);
       state->pc++;
     }
     break;
@@ -554,7 +1152,7 @@ int Emulate8080Op(State8080* state) {
     // MOV M,A
     {
       uint16_t offset = (state->h << 8) | state->l;
-      state->memory[offset] = state->a;
+      StoreByte(state, offset, state->a);
     }
     break;
   case 0x79:
@@ -591,10 +1189,8 @@ int Emulate8080Op(State8080* state) {
       // Use higher precision so that we can toggle the carry flag
       // 0xff as a mask to only look at last 8 bits
       uint16_t answer = (uint16_t) state->a + (uint16_t) state->b;
-      state->cc.z = (answer & 0xff) == 0; // Zero flag
-      state->cc.s = (answer & 0x80) != 0; // Sign flag
+      SetZSP(&state->cc, answer & 0xff); // Zero, sign and parity flags
       state->cc.cy = answer > 0xff;       // Carry
-      state->cc.p = Parity(answer & 0xff);
       state->a = answer & 0xff;
     }
     break;
@@ -605,10 +1201,8 @@ int Emulate8080Op(State8080* state) {
       // Get H, then shift it one byte left, and then combine it with L
       uint16_t offset = (state->h<<8) | (state->l);
       uint16_t answer = (uint16_t) state->a + state->memory[offset];
-      state->cc.z = (answer & 0xff) == 0; // Zero flag
-      state->cc.s = (answer & 0x80) != 0; // Sign flag
+      SetZSP(&state->cc, answer & 0xff); // Zero, sign and parity flags
       state->cc.cy = answer > 0xff;     // Carry
-      state->cc.p = Parity(answer & 0xff);
       state->a = answer & 0xff;
     }
     break;
@@ -616,18 +1210,14 @@ int Emulate8080Op(State8080* state) {
     // ANA A
     // A <- A & A
     state->a = state->a & state->a;
-    state->cc.z = state->a == 0;
-    state->cc.s = 0x80 == (0x80 & state->a);
-    state->cc.p = Parity(state->a);
+    SetZSP(&state->cc, state->a);
     state->cc.cy = 0;
     break;
   case 0xaf:
     // XRA A
     // A <- A ^ A
     state->a = state->a ^ state->a;
-    state->cc.z = state->a == 0;
-    state->cc.s = 0x80 == (0x80 & state->a);
-    state->cc.p = Parity(state->a);
+    SetZSP(&state->cc, state->a);
     state->cc.cy = 0;
     break;
   case 0xc1:
@@ -654,8 +1244,8 @@ int Emulate8080Op(State8080* state) {
     // PUSH B
     // (sp - 2) <- C; (sp - 1) <- B; sp <- sp - 2
     {
-      state->memory[state->sp - 2] = state->c;
-      state->memory[state->sp - 1] = state->b;
+      StoreByte(state, state->sp - 2, state->c);
+      StoreByte(state, state->sp - 1, state->b);
       state->sp -= 2;
     }
     break;
@@ -664,10 +1254,8 @@ int Emulate8080Op(State8080* state) {
     // A <- A + byte
     {
       uint16_t answer = (uint16_t) state->a + (uint16_t) opcode[1];
-      state->cc.z = (answer & 0xff) == 0; // Zero flag
-      state->cc.s = (answer & 0x80) != 0; // Sign flag
+      SetZSP(&state->cc, answer & 0xff); // Zero, sign and parity flags
       state->cc.cy = answer > 0xff;       // Carry
-      state->cc.p = Parity(answer & 0xff);
       state->a = answer & 0xff;
       state->pc += 1;
     }
@@ -684,8 +1272,8 @@ int Emulate8080Op(State8080* state) {
       uint16_t ret = state->pc + 2; // Address of the next instruction
       // Put address on the stack
       // 8080 is little-endian, so it stores it "backwards"
-      state->memory[state->sp - 1] = (ret >> 8) & 0xff; // First byte
-      state->memory[state->sp - 2] = ret & 0xff; // Last byte
+      StoreByte(state, state->sp - 1, (ret >> 8) & 0xff); // First byte
+      StoreByte(state, state->sp - 2, ret & 0xff); // Last byte
       state->sp = state->sp - 2; // Move stack pointer
       state->pc = (opcode[2] << 8) | opcode[1];
     }
@@ -701,15 +1289,22 @@ int Emulate8080Op(State8080* state) {
     break;
   case 0xd3:
     // OUT D8
-    // Skip for now?
+    // (port) <- A
+    state->ports->out[opcode[1]](state, opcode[1], state->a);
+    state->pc++;
+    break;
+  case 0xdb:
+    // IN D8
+    // A <- (port)
+    state->a = state->ports->in[opcode[1]](state, opcode[1]);
     state->pc++;
     break;
   case 0xd5:
     // PUSH D
     // (sp - 2) <- E; (sp - 1) <- D; sp <- sp - 2
     {
-      state->memory[state->sp - 2] = state->e;
-      state->memory[state->sp - 1] = state->d;
+      StoreByte(state, state->sp - 2, state->e);
+      StoreByte(state, state->sp - 1, state->d);
       state->sp -= 2;
     }
     break;
@@ -726,8 +1321,8 @@ int Emulate8080Op(State8080* state) {
     // PUSH H
     // (sp - 2) <- L; (sp - 1) <- H; sp <- sp - 2
     {
-      state->memory[state->sp - 2] = state->l;
-      state->memory[state->sp - 1] = state->h;
+      StoreByte(state, state->sp - 2, state->l);
+      StoreByte(state, state->sp - 1, state->h);
       state->sp -= 2;
     }
     break;
@@ -736,11 +1331,9 @@ int Emulate8080Op(State8080* state) {
     // A <- A & data
     {
       uint8_t x = state->a & opcode[1];
-      state->cc.z = x == 0;
-      // This is related to two's complement
-      // If a byte is signed and the highest bit is 1, it's negative
-      state->cc.s = (0x80 == (x & 0x80));
-      state->cc.p = Parity(x);
+      // Z, S and P come from a table. For S, this is related to two's
+      // complement: if a byte is signed and the highest bit is 1, it's negative
+      SetZSP(&state->cc, x);
       state->cc.cy = 0;
       state->a = x;
       state->pc += 1;
@@ -778,13 +1371,13 @@ int Emulate8080Op(State8080* state) {
     // PUSH PSW
     // (sp - 2) <- flags; (sp - 1) <- A; sp <- sp - 2
     {
-      state->memory[state->sp-1] = state->a;
+      StoreByte(state, state->sp - 1, state->a);
       uint8_t psw = (state->cc.z |
                      state->cc.s  << 1 |
                      state->cc.p  << 2 |
                      state->cc.cy << 3 |
                      state->cc.ac << 4 );
-      state->memory[state->sp-2] = psw;
+      StoreByte(state, state->sp - 2, psw);
       state->sp -= 2;
     }
     break;
@@ -798,10 +1391,9 @@ int Emulate8080Op(State8080* state) {
     {
       // Sets the flags but doesn't store the result
       uint8_t x = state->a - opcode[1];
-      state->cc.z = (x == 0); // Two numbers are equal
-      state->cc.s = (0x80 == (x & 0x80));
+      // Z is set when the two numbers are equal
       // Databook is unclear on how to handle parity
-      state->cc.p = Parity(x);
+      SetZSP(&state->cc, x);
       // If A is greater, CY cleared since no borrow
       // If A is less, CY set since A had to borrow
       state->cc.cy = (state->a < opcode[1]);
@@ -830,61 +1422,5126 @@ p         state->e, state->h, state->l, state->sp);
   return 0;
 }
 
-void ReadFileIntoMemoryAt(State8080* state, char* filename, uint32_t offset) {
-  // "rb" means "read binary"
-  FILE *f= fopen(filename, "rb");
-  if (f == NULL) {
-    printf("error: Couldn't open %s\n", filename);
-    exit(1);
+// Macros for the opcode handlers in ops8080.inc, shared by the engines
+// below. They work on the engine's local copies of the registers, not on
+// the State8080.
+#define RD(adr)       mem[(uint16_t) (adr)]
+#define BC            ((uint16_t) (b << 8 | c))
+#define DE            ((uint16_t) (d << 8 | e))
+#define HL            ((uint16_t) (h << 8 | l))
+#define SETPAIR(hi, lo, x) \
+  do { uint16_t _v = (x); hi = _v >> 8; lo = _v & 0xff; } while (0)
+#define ZSP(x)        (zsp = (x))
+#define ZF            (ZSPTable[zsp] & FLAG_Z)
+#define SF            (ZSPTable[zsp] & FLAG_S)
+#define PF            (ZSPTable[zsp] & FLAG_P)
+// 8080 subtraction is an add of the complement, so AC comes out inverted
+// compared to the borrow out of bit 3, and CY is the borrow.
+#define ADD8(x, carry) \
+  do { uint8_t _v = (x); uint16_t _r = a + _v + (carry); \
+       aux = a ^ _v ^ _r; cy = _r >> 8; a = _r; ZSP(a); } while (0)
+#define SUB8(x, borrow) \
+  do { uint8_t _v = (x); uint16_t _r = a - _v - (borrow); \
+       aux = ~(a ^ _v ^ _r); cy = (_r >> 8) & 1; a = _r; ZSP(a); } while (0)
+#define CMP8(x) \
+  do { uint8_t _v = (x); uint16_t _r = a - _v; uint8_t _x = _r; \
+       aux = ~(a ^ _v ^ _r); cy = (_r >> 8) & 1; ZSP(_x); } while (0)
+#define ANA8(x) \
+  do { uint8_t _v = (x); aux = (a | _v) << 1; a &= _v; cy = 0; ZSP(a); \
+  } while (0)
+#define XRA8(x)       do { a ^= (x); cy = aux = 0; ZSP(a); } while (0)
+#define ORA8(x)       do { a |= (x); cy = aux = 0; ZSP(a); } while (0)
+#define INR(r) \
+  do { uint8_t _o = r; r++; aux = _o ^ 1 ^ r; ZSP(r); } while (0)
+#define DCR(r) \
+  do { uint8_t _o = r; r--; aux = ~(_o ^ 1 ^ r); ZSP(r); } while (0)
+#define DAD(x) \
+  do { uint32_t _r = HL + (x); cy = _r >> 16; SETPAIR(h, l, _r); } while (0)
+#define DAA() \
+  do { uint8_t _fix = 0, _cy = cy; \
+       if ((aux & FLAG_AC) || (a & 0x0f) > 9) _fix = 0x06; \
+       if (cy || (a >> 4) > 9 || ((a >> 4) >= 9 && (a & 0x0f) > 9)) { \
+         _fix |= 0x60; _cy = 1; } \
+       ADD8(_fix, 0); cy = _cy; } while (0)
+// PSW is S Z 0 AC 0 P 1 CY, bit 7 first, as in the 8080 data book
+#define PSW_PACK()    (ZSPTable[zsp] | (aux & FLAG_AC) | 0x02 | cy)
+#define PSW_UNPACK(x) \
+  do { uint8_t _f = (x); zsp = 0x100 | _f; aux = _f; cy = _f & FLAG_CY; \
+  } while (0)
+#define CALL(adr, ret) \
+  do { uint16_t _to = (adr), _ret = (ret); ON_CALL(_to, _ret); \
+       WR(sp - 1, _ret >> 8); WR(sp - 2, _ret); sp -= 2; JUMP(_to); } while (0)
+#define RET() \
+  do { uint16_t _to = RD(sp) | RD(sp + 1) << 8; ON_RET(_to); \
+       sp += 2; JUMP(_to); } while (0)
+// Only RunProfiled8080 hooks calls and returns, everywhere else these are
+// empty
+#define ON_CALL(to, ret)
+#define ON_RET(to)
+
+// Run8080 fetches straight from memory at pc. Its stores still go through
+// the memory map, and drop cached blocks they overwrite, as it also
+// finishes RunCached8080's slices; and they check write watchpoints, as
+// RunDebug8080 steps with it. It does not stop on one: RunDebug8080 only
+// ever runs it for one instruction.
+#define WR(adr, x) \
+  do { uint16_t _a = (adr); uint8_t _x = (x); \
+       if (page_flags[_a >> 8]) StoreSlowPath(state, _a, _x, PC); \
+       else { mem[_a] = _x; dirty[_a >> 5] = 1; } } while (0)
+#define PC            pc
+#define IMM8          RD(pc + 1)
+#define IMM16         ((uint16_t) (RD(pc + 1) | RD(pc + 2) << 8))
+// Jump straight to the next opcode's handler, charging its cycles up front.
+// Every handler has its own copy of this, which gives the branch predictor
+// one indirect jump per opcode instead of a single shared one.
+#define DISPATCH() \
+  do { if (left <= 0) goto out; \
+       uint8_t _op = RD(pc); left -= Cycles8080[_op]; \
+       goto *dispatch[_op]; } while (0)
+#define NEXT(len)     do { pc += (len); DISPATCH(); } while (0)
+#define JUMP(adr)     do { pc = (adr); DISPATCH(); } while (0)
+#define NOW()         (base + (cycles - left))
+
+/**
+ * Threaded-code engine covering all 256 opcodes.
+ *
+ * Runs instructions until at least `cycles` T-states have passed and returns
+ * the overshoot, i.e. how far the last instruction ran past the budget. The
+ * host can subtract that from its next budget to stay in sync. The registers
+ * are copied into locals on entry and back on exit, and each handler jumps
+ * directly to the next one through a 256-entry label table (GCC "labels as
+ * values"), so there is no switch and no function call per instruction.
+ *
+ * A halted CPU just lets the budget pass, as the real one would while it
+ * waits for an interrupt.
+ *
+ * Unlike Emulate8080Op this also implements the undocumented opcodes the way
+ * the 8080 decodes them: 0x08-0x38 are NOP, 0xcb is JMP, 0xd9 is RET and
+ * 0xdd/0xed/0xfd are CALL.
+ */
+int Run8080(State8080 *state, int cycles) {
+  static const void *const dispatch[256] = {
+    &&op_00, &&op_01, &&op_02, &&op_03, &&op_04, &&op_05, &&op_06, &&op_07,
+    &&op_08, &&op_09, &&op_0a, &&op_0b, &&op_0c, &&op_0d, &&op_0e, &&op_0f,
+    &&op_10, &&op_11, &&op_12, &&op_13, &&op_14, &&op_15, &&op_16, &&op_17,
+    &&op_18, &&op_19, &&op_1a, &&op_1b, &&op_1c, &&op_1d, &&op_1e, &&op_1f,
+    &&op_20, &&op_21, &&op_22, &&op_23, &&op_24, &&op_25, &&op_26, &&op_27,
+    &&op_28, &&op_29, &&op_2a, &&op_2b, &&op_2c, &&op_2d, &&op_2e, &&op_2f,
+    &&op_30, &&op_31, &&op_32, &&op_33, &&op_34, &&op_35, &&op_36, &&op_37,
+    &&op_38, &&op_39, &&op_3a, &&op_3b, &&op_3c, &&op_3d, &&op_3e, &&op_3f,
+    &&op_40, &&op_41, &&op_42, &&op_43, &&op_44, &&op_45, &&op_46, &&op_47,
+    &&op_48, &&op_49, &&op_4a, &&op_4b, &&op_4c, &&op_4d, &&op_4e, &&op_4f,
+    &&op_50, &&op_51, &&op_52, &&op_53, &&op_54, &&op_55, &&op_56, &&op_57,
+    &&op_58, &&op_59, &&op_5a, &&op_5b, &&op_5c, &&op_5d, &&op_5e, &&op_5f,
+    &&op_60, &&op_61, &&op_62, &&op_63, &&op_64, &&op_65, &&op_66, &&op_67,
+    &&op_68, &&op_69, &&op_6a, &&op_6b, &&op_6c, &&op_6d, &&op_6e, &&op_6f,
+    &&op_70, &&op_71, &&op_72, &&op_73, &&op_74, &&op_75, &&op_76, &&op_77,
+    &&op_78, &&op_79, &&op_7a, &&op_7b, &&op_7c, &&op_7d, &&op_7e, &&op_7f,
+    &&op_80, &&op_81, &&op_82, &&op_83, &&op_84, &&op_85, &&op_86, &&op_87,
+    &&op_88, &&op_89, &&op_8a, &&op_8b, &&op_8c, &&op_8d, &&op_8e, &&op_8f,
+    &&op_90, &&op_91, &&op_92, &&op_93, &&op_94, &&op_95, &&op_96, &&op_97,
+    &&op_98, &&op_99, &&op_9a, &&op_9b, &&op_9c, &&op_9d, &&op_9e, &&op_9f,
+    &&op_a0, &&op_a1, &&op_a2, &&op_a3, &&op_a4, &&op_a5, &&op_a6, &&op_a7,
+    &&op_a8, &&op_a9, &&op_aa, &&op_ab, &&op_ac, &&op_ad, &&op_ae, &&op_af,
+    &&op_b0, &&op_b1, &&op_b2, &&op_b3, &&op_b4, &&op_b5, &&op_b6, &&op_b7,
+    &&op_b8, &&op_b9, &&op_ba, &&op_bb, &&op_bc, &&op_bd, &&op_be, &&op_bf,
+    &&op_c0, &&op_c1, &&op_c2, &&op_c3, &&op_c4, &&op_c5, &&op_c6, &&op_c7,
+    &&op_c8, &&op_c9, &&op_ca, &&op_cb, &&op_cc, &&op_cd, &&op_ce, &&op_cf,
+    &&op_d0, &&op_d1, &&op_d2, &&op_d3, &&op_d4, &&op_d5, &&op_d6, &&op_d7,
+    &&op_d8, &&op_d9, &&op_da, &&op_db, &&op_dc, &&op_dd, &&op_de, &&op_df,
+    &&op_e0, &&op_e1, &&op_e2, &&op_e3, &&op_e4, &&op_e5, &&op_e6, &&op_e7,
+    &&op_e8, &&op_e9, &&op_ea, &&op_eb, &&op_ec, &&op_ed, &&op_ee, &&op_ef,
+    &&op_f0, &&op_f1, &&op_f2, &&op_f3, &&op_f4, &&op_f5, &&op_f6, &&op_f7,
+    &&op_f8, &&op_f9, &&op_fa, &&op_fb, &&op_fc, &&op_fd, &&op_fe, &&op_ff,
+  };
+  const uint8_t *page_flags = state->page_flags;
+  uint8_t *mem = state->memory;
+  uint8_t *dirty = state->dirty;
+  uint8_t a = state->a, b = state->b, c = state->c, d = state->d;
+  uint8_t e = state->e, h = state->h, l = state->l;
+  uint16_t sp = state->sp, pc = state->pc;
+  LazyFlags flags = LazyFlagsFromCC(state->cc);
+  uint16_t zsp = flags.zsp;
+  uint8_t aux = flags.aux, cy = flags.cy;
+  int left = cycles;
+  uint64_t base = state->cycles;
+
+  if (state->halted) {
+    state->cycles += cycles;
+    return 0;
   }
+  DISPATCH();
 
-  // Get the file size and read it into a memory buffer
-  // fseek sets the file position of the stream
-  // int fseek(FILE *stream, long int offset, int whence)
-  fseek(f, 0L, SEEK_END); // Sets stream to end of file
-  int fsize = ftell(f); // returns the current file position
-  fseek(f, 0L, SEEK_SET); // Sets stream back to the beginning
-
-  uint8_t *buffer = &state->memory[offset];
-  // fread is for binary i/o
-  // fread(
-  //   void *ptr,
-  //   size_t size_of_elements,
-  //   size_t number_of_elements,
-  //   FILE *a_file
-  // )
-  // Basically to read the whole file, it's:
-  // fread(buffer, MAX_FILE_SIZE, 1, f)
-  fread(buffer, fsize, 1, f);
-  fclose(f);
+#include "ops8080.inc"
+
+ out:
+  state->a = a; state->b = b; state->c = c; state->d = d;
+  state->e = e; state->h = h; state->l = l;
+  state->sp = sp; state->pc = pc;
+  flags.zsp = zsp; flags.aux = aux; flags.cy = cy;
+  LazyFlagsToCC(flags, &state->cc);
+  if (state->halted && left > 0)
+    left = 0;
+  state->cycles = base + (cycles - left);
+  return -left;
 }
 
-State8080* Init8080(void) {
-  State8080* state = calloc(1, sizeof(State8080));
-  state->memory = malloc(0x10000); // 16k
-  return state;
+// The profiled engine is Run8080 with counters. The dispatch only counts
+// the instruction about to run, at its address and under its opcode; the
+// cycles are worked out from the counts when the report is made, except for
+// the extra cycles of a taken conditional call or return, which the call and
+// return hooks add.
+#undef DISPATCH
+#define DISPATCH() \
+  do { if (left <= 0) goto out; \
+       uint8_t _op = RD(pc); prof->pc[pc].count++; prof->op[_op].count++; \
+       left -= Cycles8080[_op]; goto *dispatch[_op]; } while (0)
+#undef ON_CALL
+#undef ON_RET
+#define ON_CALL(to, ret) ProfileCall(prof, mem, PC, to, ret, NOW())
+#define ON_RET(to)       ProfileReturn(prof, mem, PC, to, NOW())
+
+// Charges a taken conditional call or return at `pc` its extra 6 cycles
+static inline void ProfileTaken(Profile *prof, const uint8_t *mem,
+                                uint16_t pc) {
+  uint8_t op = mem[pc];
+  if ((op & 0xc7) == 0xc0 || (op & 0xc7) == 0xc4) {
+    prof->pc[pc].cycles += 6;
+    prof->op[op].cycles += 6;
+  }
+}
+
+// Counts a call from `site` and starts timing it
+static void ProfileCall(Profile *prof, const uint8_t *mem, uint16_t site,
+                        uint16_t to, uint16_t ret, uint64_t now) {
+  ProfileTaken(prof, mem, site);
+  uint32_t key = (uint32_t) site << 16 | to;
+  uint32_t i = (key * 2654435761u) >> 20 & (PROFILE_EDGES - 1);
+  int probes = 0;
+  while (prof->edges[i].used &&
+         (prof->edges[i].site != site || prof->edges[i].target != to)) {
+    i = (i + 1) & (PROFILE_EDGES - 1);
+    if (++probes == PROFILE_EDGES) {
+      prof->lost_edges++;
+      return;
+    }
+  }
+  ProfileEdge *edge = &prof->edges[i];
+  edge->used = 1;
+  edge->site = site;
+  edge->target = to;
+  edge->calls++;
+  if (prof->depth < PROFILE_DEPTH)
+    prof->stack[prof->depth++] = (ProfileFrame) { edge, ret, now };
+}
+
+// A return to `to` ends the innermost call that was to return there. Calls
+// above it, which the game left some other way (it drops return addresses
+// off the stack now and then), are forgotten; a return that matches no call,
+// such as the end of an interrupt handler, is ignored.
+static void ProfileReturn(Profile *prof, const uint8_t *mem, uint16_t pc,
+                          uint16_t to, uint64_t now) {
+  ProfileTaken(prof, mem, pc);
+  for (int k = prof->depth - 1; k >= 0; k--) {
+    if (prof->stack[k].ret == to) {
+      prof->stack[k].edge->cycles += now - prof->stack[k].start;
+      prof->depth = k;
+      return;
+    }
+  }
 }
 
 /**
- * int argc - the # of args passed into the program, always at least 1, since
- * the first arg is the call to the program itself
+ * Run8080 with a profiler: the same results, with every instruction counted
+ * in state->profile. It is a separate copy of the engine so that Run8080
+ * itself does not have a single extra instruction for it.
+ */
+int RunProfiled8080(State8080 *state, int cycles) {
+  static const void *const dispatch[256] = {
+    &&op_00, &&op_01, &&op_02, &&op_03, &&op_04, &&op_05, &&op_06, &&op_07,
+    &&op_08, &&op_09, &&op_0a, &&op_0b, &&op_0c, &&op_0d, &&op_0e, &&op_0f,
+    &&op_10, &&op_11, &&op_12, &&op_13, &&op_14, &&op_15, &&op_16, &&op_17,
+    &&op_18, &&op_19, &&op_1a, &&op_1b, &&op_1c, &&op_1d, &&op_1e, &&op_1f,
+    &&op_20, &&op_21, &&op_22, &&op_23, &&op_24, &&op_25, &&op_26, &&op_27,
+    &&op_28, &&op_29, &&op_2a, &&op_2b, &&op_2c, &&op_2d, &&op_2e, &&op_2f,
+    &&op_30, &&op_31, &&op_32, &&op_33, &&op_34, &&op_35, &&op_36, &&op_37,
+    &&op_38, &&op_39, &&op_3a, &&op_3b, &&op_3c, &&op_3d, &&op_3e, &&op_3f,
+    &&op_40, &&op_41, &&op_42, &&op_43, &&op_44, &&op_45, &&op_46, &&op_47,
+    &&op_48, &&op_49, &&op_4a, &&op_4b, &&op_4c, &&op_4d, &&op_4e, &&op_4f,
+    &&op_50, &&op_51, &&op_52, &&op_53, &&op_54, &&op_55, &&op_56, &&op_57,
+    &&op_58, &&op_59, &&op_5a, &&op_5b, &&op_5c, &&op_5d, &&op_5e, &&op_5f,
+    &&op_60, &&op_61, &&op_62, &&op_63, &&op_64, &&op_65, &&op_66, &&op_67,
+    &&op_68, &&op_69, &&op_6a, &&op_6b, &&op_6c, &&op_6d, &&op_6e, &&op_6f,
+    &&op_70, &&op_71, &&op_72, &&op_73, &&op_74, &&op_75, &&op_76, &&op_77,
+    &&op_78, &&op_79, &&op_7a, &&op_7b, &&op_7c, &&op_7d, &&op_7e, &&op_7f,
+    &&op_80, &&op_81, &&op_82, &&op_83, &&op_84, &&op_85, &&op_86, &&op_87,
+    &&op_88, &&op_89, &&op_8a, &&op_8b, &&op_8c, &&op_8d, &&op_8e, &&op_8f,
+    &&op_90, &&op_91, &&op_92, &&op_93, &&op_94, &&op_95, &&op_96, &&op_97,
+    &&op_98, &&op_99, &&op_9a, &&op_9b, &&op_9c, &&op_9d, &&op_9e, &&op_9f,
+    &&op_a0, &&op_a1, &&op_a2, &&op_a3, &&op_a4, &&op_a5, &&op_a6, &&op_a7,
+    &&op_a8, &&op_a9, &&op_aa, &&op_ab, &&op_ac, &&op_ad, &&op_ae, &&op_af,
+    &&op_b0, &&op_b1, &&op_b2, &&op_b3, &&op_b4, &&op_b5, &&op_b6, &&op_b7,
+    &&op_b8, &&op_b9, &&op_ba, &&op_bb, &&op_bc, &&op_bd, &&op_be, &&op_bf,
+    &&op_c0, &&op_c1, &&op_c2, &&op_c3, &&op_c4, &&op_c5, &&op_c6, &&op_c7,
+    &&op_c8, &&op_c9, &&op_ca, &&op_cb, &&op_cc, &&op_cd, &&op_ce, &&op_cf,
+    &&op_d0, &&op_d1, &&op_d2, &&op_d3, &&op_d4, &&op_d5, &&op_d6, &&op_d7,
+    &&op_d8, &&op_d9, &&op_da, &&op_db, &&op_dc, &&op_dd, &&op_de, &&op_df,
+    &&op_e0, &&op_e1, &&op_e2, &&op_e3, &&op_e4, &&op_e5, &&op_e6, &&op_e7,
+    &&op_e8, &&op_e9, &&op_ea, &&op_eb, &&op_ec, &&op_ed, &&op_ee, &&op_ef,
+    &&op_f0, &&op_f1, &&op_f2, &&op_f3, &&op_f4, &&op_f5, &&op_f6, &&op_f7,
+    &&op_f8, &&op_f9, &&op_fa, &&op_fb, &&op_fc, &&op_fd, &&op_fe, &&op_ff,
+  };
+  const uint8_t *page_flags = state->page_flags;
+  if (state->profile == NULL)
+    state->profile = calloc(1, sizeof(Profile));
+  Profile *prof = state->profile;
+  uint8_t *mem = state->memory;
+  uint8_t *dirty = state->dirty;
+  uint8_t a = state->a, b = state->b, c = state->c, d = state->d;
+  uint8_t e = state->e, h = state->h, l = state->l;
+  uint16_t sp = state->sp, pc = state->pc;
+  LazyFlags flags = LazyFlagsFromCC(state->cc);
+  uint16_t zsp = flags.zsp;
+  uint8_t aux = flags.aux, cy = flags.cy;
+  int left = cycles;
+  uint64_t base = state->cycles;
+
+  if (state->halted) {
+    state->cycles += cycles;
+    return 0;
+  }
+  DISPATCH();
+
+#include "ops8080.inc"
+
+ out:
+  state->a = a; state->b = b; state->c = c; state->d = d;
+  state->e = e; state->h = h; state->l = l;
+  state->sp = sp; state->pc = pc;
+  flags.zsp = zsp; flags.aux = aux; flags.cy = cy;
+  LazyFlagsToCC(flags, &state->cc);
+  if (state->halted && left > 0)
+    left = 0;
+  state->cycles = base + (cycles - left);
+  return -left;
+}
+
+#undef ON_CALL
+#undef ON_RET
+#define ON_CALL(to, ret)
+#define ON_RET(to)
+
+#undef WR
+#undef PC
+#undef IMM8
+#undef IMM16
+#undef DISPATCH
+#undef NEXT
+#undef JUMP
+#undef NOW
+
+/**
+ * Throws away every cached block with code on `page`, or on a mirror of it,
+ * after a store to it.
+ */
+static void InvalidateCodePage(State8080 *state, uint8_t page) {
+  BlockCache *cache = state->blocks;
+  uint8_t mask = state->map->page_mask;
+  for (int i = 0; i < BLOCK_CACHE_SIZE; i++) {
+    Block *blk = &cache->blocks[i];
+    if (!blk->valid)
+      continue;
+    // A block covers pages pc >> 8 to (end - 1) >> 8, possibly wrapping
+    // around the top of memory
+    uint8_t first = blk->pc >> 8;
+    uint8_t span = (uint8_t) ((uint16_t) (blk->end - 1) >> 8) - first;
+    for (int k = 0; k <= span; k++) {
+      if ((uint8_t) (first + k - page) & mask)
+        continue;
+      blk->valid = 0;
+      cache->invalidations++;
+      break;
+    }
+  }
+  for (int q = page & mask; q < 256; q += mask + 1)
+    state->page_flags[q] &= ~PAGE_CODE;
+}
+
+/**
+ * Empties the block cache. Needed after changing memory behind the CPU's
+ * back, e.g. loading a ROM or restoring RAM.
+ */
+void FlushBlockCache(State8080 *state) {
+  if (state->blocks == NULL)
+    return;
+  for (int i = 0; i < BLOCK_CACHE_SIZE; i++)
+    state->blocks->blocks[i].valid = 0;
+  for (int page = 0; page < 256; page++)
+    state->page_flags[page] &= ~PAGE_CODE;
+}
+
+// Opcodes after which execution never simply falls through to the next
+// instruction: JMP, CALL, RET, RST, PCHL and HLT, undocumented aliases too.
+static int EndsBlock(uint8_t op) {
+  return op == 0xc3 || op == 0xcb || op == 0xcd || op == 0xdd || op == 0xed ||
+         op == 0xfd || op == 0xc9 || op == 0xd9 || (op & 0xc7) == 0xc7 ||
+         op == 0xe9 || op == 0x76;
+}
+
+// Flags the pages a new block was decoded from, and their mirrors, which
+// are the same memory
+static void MarkCodePages(State8080 *state, const Block *blk) {
+  uint8_t mask = state->map->page_mask;
+  for (uint8_t page = blk->pc >> 8; ; page++) {
+    for (int q = page & mask; q < 256; q += mask + 1)
+      state->page_flags[q] |= PAGE_CODE;
+    if (page == (uint8_t) ((uint16_t) (blk->end - 1) >> 8))
+      break;
+  }
+}
+
+// Loops the game spends most of its time in: counting and finding live
+// invaders, drawing sprites a column at a time, copying, clearing the screen
+// and waiting for the video interrupt. In the patterns ANY is any byte, and
+// LO/HI are the loop's own address, i.e. the closing JNZ must jump back to
+// the first instruction.
+#define ANY  -1
+#define LO   -2
+#define HI   -3
+static const struct {
+  uint16_t  uop;
+  uint8_t   len;
+  int16_t   code[13];
+} Idioms[] = {
+  {UOP_COPY,         8, {0x1a, 0x77, 0x23, 0x13, 0x05, 0xc2, LO, HI}},
+  {UOP_FILL,         9, {0x36, ANY, 0x23, 0x7c, 0xfe, ANY, 0xc2, LO, HI}},
+  {UOP_COLUMN_COPY, 13, {0xc5, 0x1a, 0x77, 0x13, 0x01, ANY, ANY, 0x09, 0xc1,
+                         0x05, 0xc2, LO, HI}},
+  {UOP_COLUMN_FILL, 11, {0xc5, 0x77, 0x01, ANY, ANY, 0x09, 0xc1, 0x05, 0xc2,
+                         LO, HI}},
+  {UOP_COUNT,       11, {0x7e, 0xa7, 0xca, ANY, ANY, 0x0c, 0x23, 0x05, 0xc2,
+                         LO, HI}},
+  {UOP_SCAN,        10, {0x7e, 0xa7, 0xc2, ANY, ANY, 0x23, 0x05, 0xc2, LO, HI}},
+  {UOP_WAIT_ANA,     7, {0x3a, ANY, ANY, 0xa7, 0xc2, LO, HI}},
+  {UOP_WAIT_DCR,     7, {0x3a, ANY, ANY, 0x3d, 0xc2, LO, HI}},
+};
+
+/**
+ * If the code at pc is one of the Idioms, fills in `u` (when not NULL) as a
+ * single micro-op for the whole loop and returns 1. Its cycles are for one
+ * pass round the loop, taking the longest path.
+ */
+static int MatchIdiom(const uint8_t *mem, uint16_t pc, MicroOp *u) {
+  for (size_t i = 0; i < sizeof(Idioms) / sizeof(Idioms[0]); i++) {
+    int k, cycles = 0;
+    for (k = 0; k < Idioms[i].len; k++) {
+      int16_t want = Idioms[i].code[k];
+      uint8_t got = mem[(uint16_t) (pc + k)];
+      if (want == LO ? got != (pc & 0xff) : want == HI ? got != pc >> 8 :
+          want != ANY && got != want)
+        break;
+    }
+    if (k < Idioms[i].len)
+      continue;
+    // Operands, all at fixed offsets into the loop
+    uint16_t imm = 0, at = pc + 1;
+    switch (Idioms[i].uop) {
+    case UOP_FILL:        // fill byte, then the value of H to stop at
+      imm = mem[(uint16_t) (pc + 1)] | mem[(uint16_t) (pc + 5)] << 8;
+      break;
+    case UOP_COLUMN_COPY: // stride
+      at = pc + 5;
+      break;
+    case UOP_COLUMN_FILL: // stride
+      at = pc + 3;
+      break;
+    case UOP_COUNT:       // the JZ has to skip just the INR C
+    case UOP_SCAN:        // where to go on finding one
+      at = pc + 3;
+      break;
+    }
+    if (Idioms[i].uop != UOP_FILL)
+      imm = mem[at] | mem[(uint16_t) (at + 1)] << 8;
+    if (Idioms[i].uop == UOP_COUNT && imm != (uint16_t) (pc + 6))
+      continue;
+    if (u == NULL)
+      return 1;
+    for (k = 0; k < Idioms[i].len; k += Length8080[mem[(uint16_t) (pc + k)]])
+      cycles += Cycles8080[mem[(uint16_t) (pc + k)]];
+    u->op = Idioms[i].uop;
+    u->imm = imm;
+    u->pc = pc;
+    u->rest = 0;
+    u->cycles = cycles;
+    u->len = Idioms[i].len;
+    return 1;
+  }
+  return 0;
+}
+#undef ANY
+#undef LO
+#undef HI
+
+static void DecodeBlock(State8080 *state, Block *blk, const uint8_t *mem,
+                        uint16_t pc) {
+  BlockCache *cache = state->blocks;
+  int n = 0;
+  uint8_t op = 0;
+  blk->pc = pc;
+  blk->cycles = 0;
+  // On a page with a breakpoint: a block that just hands back to
+  // RunDebug8080. Changing the breakpoints flushes the cache.
+  if (cache->break_page[pc >> 8]) {
+    blk->ops[0] = (MicroOp) { .op = UOP_STOP, .pc = pc };
+    blk->end = pc + 1;
+    blk->count = 1;
+    blk->valid = 1;
+    cache->decodes++;
+    return;
+  }
+  if (MatchIdiom(mem, pc, &blk->ops[0]) &&
+      !cache->break_page[(uint16_t) (pc + blk->ops[0].len - 1) >> 8]) {
+    blk->cycles = blk->ops[0].cycles;
+    blk->end = pc + blk->ops[0].len;
+    blk->count = 1;
+    blk->valid = 1;
+    MarkCodePages(state, blk);
+    cache->decodes++;
+    return;
+  }
+  do {
+    // Stop in front of a loop we can run in one go, or of a breakpoint page
+    if (n > 0 && (MatchIdiom(mem, pc, NULL) || cache->break_page[pc >> 8]))
+      break;
+    MicroOp *u = &blk->ops[n++];
+    op = mem[pc];
+    u->op = op;
+    u->pc = pc;
+    u->len = Length8080[op];
+    u->cycles = Cycles8080[op];
+    if (u->len == 2)
+      u->imm = mem[(uint16_t) (pc + 1)];
+    else if (u->len == 3)
+      u->imm = mem[(uint16_t) (pc + 1)] | mem[(uint16_t) (pc + 2)] << 8;
+    else
+      u->imm = 0;
+    blk->cycles += u->cycles;
+    pc += u->len;
+  } while (!EndsBlock(op) && n < BLOCK_MAX_OPS);
+  if (!EndsBlock(op)) {
+    MicroOp *u = &blk->ops[n++];
+    u->op = UOP_END;
+    u->pc = pc;
+    u->len = 0;
+    u->cycles = 0;
+    u->imm = 0;
+  }
+  blk->end = pc;
+  blk->count = n;
+  blk->valid = 1;
+  for (int i = n - 1, rest = 0; i >= 0; i--) {
+    blk->ops[i].rest = rest;
+    rest += blk->ops[i].cycles;
+  }
+  MarkCodePages(state, blk);
+  cache->decodes++;
+}
+
+// Helpers for the fused loops in RunCached8080, all wrapping around the top
+// of memory like the 8080 does.
+
+static int RangeHasCode(const uint8_t *page_flags, uint16_t adr, int n) {
+  int pages = ((adr & 0xff) + n + 0xff) >> 8;
+  for (int i = 0; i < pages && i < 256; i++)
+    if (page_flags[(uint8_t) ((adr >> 8) + i)])
+      return 1;
+  return 0;
+}
+
+static void MarkDirtyRange(uint8_t *dirty, uint16_t adr, int n) {
+  int count = ((adr & 31) + n + 31) >> 5;
+  for (int i = 0; i < count && i < (0x10000 >> 5); i++)
+    dirty[((adr >> 5) + i) & ((0x10000 >> 5) - 1)] = 1;
+}
+
+// Byte by byte, first to last, as LDAX D / MOV M,A would. memmove gives the
+// same result unless dst is a little way above src, where the loop smears.
+// With the mirrors mapped, an address above 3FFF is the same byte as its
+// image in the first 16K, so the overlap is looked for there; a range that
+// runs across a mirror's end takes the loop.
+static void CopyForward(uint8_t *mem, int mapped, uint16_t dst, uint16_t src,
+                        int n) {
+  int flat = 1;
+  if (mapped) {
+    flat = (dst & (MIRROR_SIZE - 1)) + n <= MIRROR_SIZE &&
+           (src & (MIRROR_SIZE - 1)) + n <= MIRROR_SIZE;
+    if (flat) {
+      dst &= MIRROR_SIZE - 1;
+      src &= MIRROR_SIZE - 1;
+    }
+  }
+  if (flat && dst + n <= 0x10000 && src + n <= 0x10000 &&
+      (uint16_t) (dst - src) >= n)
+    memmove(mem + dst, mem + src, n);
+  else
+    for (int i = 0; i < n; i++)
+      mem[(uint16_t) (dst + i)] = mem[(uint16_t) (src + i)];
+}
+
+static void FillForward(uint8_t *mem, uint16_t dst, uint8_t value, int n) {
+  if (dst + n <= 0x10000)
+    memset(mem + dst, value, n);
+  else
+    for (int i = 0; i < n; i++)
+      mem[(uint16_t) (dst + i)] = value;
+}
+
+// RunCached8080 runs micro-ops out of a Block; `u` is the current one. The
+// whole block's cycles are charged on entry, so moving from op to op needs
+// no budget check. Leaving the block early through a taken conditional jump,
+// call or return refunds the ops that did not run.
+#define WR(adr, x) \
+  do { uint16_t _a = (adr); uint8_t _x = (x); \
+       if (!page_flags[_a >> 8]) { mem[_a] = _x; dirty[_a >> 5] = 1; } \
+       else { if (StoreSlowPath(state, _a, _x, PC)) WATCH(); SMC(); } \
+  } while (0)
+// A store hit a write watchpoint. The engine stops at the next block
+// boundary: the budget is held back so that the next lookup finds none
+// left, and handed back at the end.
+#define WATCH() \
+  do { left -= DEBUG_HOLD; held += DEBUG_HOLD; } while (0)
+// The store may have hit cached code. If that code includes the running
+// block, the rest of the block may be stale: turn the next op into an
+// exit, so that execution carries on from a fresh decode.
+#define SMC() \
+  do { if (!blk->valid && u + 1 < &blk->ops[blk->count]) { \
+         MicroOp *_n = (MicroOp *) u + 1; \
+         _n->rest += _n->cycles; _n->cycles = 0; _n->op = UOP_END; \
+       } } while (0)
+// More than any budget
+#define DEBUG_HOLD    (1 << 28)
+#define PC            (u->pc)
+#define IMM8          ((uint8_t) u->imm)
+#define IMM16         (u->imm)
+#define NEXT(len)     do { u++; goto *dispatch[u->op]; } while (0)
+// A jump back to the start of the running block (a wait or copy loop) skips
+// the hash lookup.
+#define JUMP(adr) \
+  do { pc = (adr); left += u->rest; \
+       if (pc == blk->pc && blk->valid && blk->cycles < left) { \
+         left -= blk->cycles; u = blk->ops; goto *dispatch[u->op]; } \
+       goto lookup; } while (0)
+#define NOW()         (base + (cycles - left - held - u->rest))
+
+/**
+ * Block-cached engine, with the same interface and results as Run8080.
  *
- * char **argv - pointer to a char *, since C-style strings are just char *
- * arrays, this could be also written as char *argv[] (array of char *)
+ * Instead of fetching and decoding every instruction from guest memory, it
+ * looks up the block starting at pc in a cache of pre-decoded micro-ops and
+ * runs those, only decoding on a miss. Stores to a page holding cached code
+ * drop the blocks on it, so code in RAM can be modified. The ROM never is,
+ * so once the game has warmed up nearly every block comes from the cache.
  *
+ * The budget is only checked between blocks. The last few instructions of a
+ * slice, once the next block no longer fits in it, are left to Run8080, which
+ * checks before every instruction; so both engines stop in the same place.
  */
-int main(int argc, char **argv) {
-  State8080* state = Init8080();
+int RunCached8080(State8080 *state, int cycles) {
+  static const void *const dispatch[UOP_LAST + 1] = {
+    &&op_00, &&op_01, &&op_02, &&op_03, &&op_04, &&op_05, &&op_06, &&op_07,
+    &&op_08, &&op_09, &&op_0a, &&op_0b, &&op_0c, &&op_0d, &&op_0e, &&op_0f,
+    &&op_10, &&op_11, &&op_12, &&op_13, &&op_14, &&op_15, &&op_16, &&op_17,
+    &&op_18, &&op_19, &&op_1a, &&op_1b, &&op_1c, &&op_1d, &&op_1e, &&op_1f,
+    &&op_20, &&op_21, &&op_22, &&op_23, &&op_24, &&op_25, &&op_26, &&op_27,
+    &&op_28, &&op_29, &&op_2a, &&op_2b, &&op_2c, &&op_2d, &&op_2e, &&op_2f,
+    &&op_30, &&op_31, &&op_32, &&op_33, &&op_34, &&op_35, &&op_36, &&op_37,
+    &&op_38, &&op_39, &&op_3a, &&op_3b, &&op_3c, &&op_3d, &&op_3e, &&op_3f,
+    &&op_40, &&op_41, &&op_42, &&op_43, &&op_44, &&op_45, &&op_46, &&op_47,
+    &&op_48, &&op_49, &&op_4a, &&op_4b, &&op_4c, &&op_4d, &&op_4e, &&op_4f,
+    &&op_50, &&op_51, &&op_52, &&op_53, &&op_54, &&op_55, &&op_56, &&op_57,
+    &&op_58, &&op_59, &&op_5a, &&op_5b, &&op_5c, &&op_5d, &&op_5e, &&op_5f,
+    &&op_60, &&op_61, &&op_62, &&op_63, &&op_64, &&op_65, &&op_66, &&op_67,
+    &&op_68, &&op_69, &&op_6a, &&op_6b, &&op_6c, &&op_6d, &&op_6e, &&op_6f,
+    &&op_70, &&op_71, &&op_72, &&op_73, &&op_74, &&op_75, &&op_76, &&op_77,
+    &&op_78, &&op_79, &&op_7a, &&op_7b, &&op_7c, &&op_7d, &&op_7e, &&op_7f,
+    &&op_80, &&op_81, &&op_82, &&op_83, &&op_84, &&op_85, &&op_86, &&op_87,
+    &&op_88, &&op_89, &&op_8a, &&op_8b, &&op_8c, &&op_8d, &&op_8e, &&op_8f,
+    &&op_90, &&op_91, &&op_92, &&op_93, &&op_94, &&op_95, &&op_96, &&op_97,
+    &&op_98, &&op_99, &&op_9a, &&op_9b, &&op_9c, &&op_9d, &&op_9e, &&op_9f,
+    &&op_a0, &&op_a1, &&op_a2, &&op_a3, &&op_a4, &&op_a5, &&op_a6, &&op_a7,
+    &&op_a8, &&op_a9, &&op_aa, &&op_ab, &&op_ac, &&op_ad, &&op_ae, &&op_af,
+    &&op_b0, &&op_b1, &&op_b2, &&op_b3, &&op_b4, &&op_b5, &&op_b6, &&op_b7,
+    &&op_b8, &&op_b9, &&op_ba, &&op_bb, &&op_bc, &&op_bd, &&op_be, &&op_bf,
+    &&op_c0, &&op_c1, &&op_c2, &&op_c3, &&op_c4, &&op_c5, &&op_c6, &&op_c7,
+    &&op_c8, &&op_c9, &&op_ca, &&op_cb, &&op_cc, &&op_cd, &&op_ce, &&op_cf,
+    &&op_d0, &&op_d1, &&op_d2, &&op_d3, &&op_d4, &&op_d5, &&op_d6, &&op_d7,
+    &&op_d8, &&op_d9, &&op_da, &&op_db, &&op_dc, &&op_dd, &&op_de, &&op_df,
+    &&op_e0, &&op_e1, &&op_e2, &&op_e3, &&op_e4, &&op_e5, &&op_e6, &&op_e7,
+    &&op_e8, &&op_e9, &&op_ea, &&op_eb, &&op_ec, &&op_ed, &&op_ee, &&op_ef,
+    &&op_f0, &&op_f1, &&op_f2, &&op_f3, &&op_f4, &&op_f5, &&op_f6, &&op_f7,
+    &&op_f8, &&op_f9, &&op_fa, &&op_fb, &&op_fc, &&op_fd, &&op_fe, &&op_ff,
+    &&op_end, &&op_copy, &&op_fill, &&op_column_copy, &&op_column_fill,
+    &&op_count, &&op_scan, &&op_wait_ana, &&op_wait_dcr, &&op_stop,
+  };
+  if (state->blocks == NULL)
+    state->blocks = calloc(1, sizeof(BlockCache));
+  BlockCache *cache = state->blocks;
+  const uint8_t *page_flags = state->page_flags;
+  uint8_t *mem = state->memory;
+  uint8_t *dirty = state->dirty;
+  uint8_t a = state->a, b = state->b, c = state->c, d = state->d;
+  uint8_t e = state->e, h = state->h, l = state->l;
+  uint16_t sp = state->sp, pc = state->pc;
+  LazyFlags flags = LazyFlagsFromCC(state->cc);
+  uint16_t zsp = flags.zsp;
+  uint8_t aux = flags.aux, cy = flags.cy;
+  int left = cycles, held = 0;
+  uint64_t base = state->cycles;
+  Block *blk;
+  const MicroOp *u;
+
+  if (state->halted) {
+    state->cycles += cycles;
+    return 0;
+  }
+
+ lookup:
+  if (left <= 0)
+    goto out;
+  blk = &cache->blocks[(pc ^ (pc >> 10)) & (BLOCK_CACHE_SIZE - 1)];
+  cache->lookups++;
+  if (!blk->valid || blk->pc != pc)
+    DecodeBlock(state, blk, mem, pc);
+  if (blk->cycles >= left)
+    goto out;
+  left -= blk->cycles;
+  u = blk->ops;
+  goto *dispatch[u->op];
+
+#include "ops8080.inc"
+
+ op_end:
+  JUMP(u->pc);
 
-  int done = 0;
+ op_stop:
+  left += u->rest;
+  pc = u->pc;
+  goto out;
 
-  ReadFileIntoMemoryAt(state, "invaders.h", 0);
-  ReadFileIntoMemoryAt(state, "invaders.g", 0x800);
-  ReadFileIntoMemoryAt(state, "invaders.f", 0x1000);
-  ReadFileIntoMemoryAt(state, "invaders.e", 0x1800);
-  while (done == 0) {
-    done = Emulate8080Op(state);
+  // The fused loops. Each takes back the one pass that lookup charged, runs
+  // as many whole passes as will still leave some budget, and sets the
+  // registers, flags and memory to exactly what the instructions would have.
+  // If the budget ends first, it stops at the top of the loop and leaves the
+  // last pass to Run8080, like a block that does not fit. Anything awkward,
+  // such as writing over cached code or the stack, goes to Run8080 as well.
+#define PASSES(count) \
+  int n = (count), m = (left += u->cycles, (left - 1) / u->cycles); \
+  if (m > n) m = n
+#define DONE(passes, count) \
+  do { if ((passes) == (count)) { pc = u->pc + u->len; goto lookup; } \
+       pc = u->pc; goto out; } while (0)
+
+ op_copy: {
+    PASSES(b ? b : 256);
+    uint16_t src = DE, dst = HL;
+    if (RangeHasCode(page_flags, dst, m))
+      goto bail;
+    CopyForward(mem, state->mapped, dst, src, m);
+    MarkDirtyRange(dirty, dst, m);
+    a = RD(src + m - 1);
+    SETPAIR(h, l, dst + m);
+    SETPAIR(d, e, src + m);
+    b -= m - 1;
+    DCR(b);
+    left -= m * u->cycles;
+    DONE(m, n);
   }
 
-  return 0;
+ op_fill: {
+    // Passes until INX H leaves H equal to the CPI operand
+    uint8_t stop = u->imm >> 8;
+    PASSES(h == stop && l != 0xff ? 1 : (uint16_t) ((stop << 8) - HL));
+    uint16_t dst = HL;
+    if (RangeHasCode(page_flags, dst, m))
+      goto bail;
+    FillForward(mem, dst, (uint8_t) u->imm, m);
+    MarkDirtyRange(dirty, dst, m);
+    SETPAIR(h, l, dst + m);
+    a = h;
+    CMP8(stop);
+    left -= m * u->cycles;
+    DONE(m, n);
+  }
+
+ op_column_copy:
+ op_column_fill: {
+    // PUSH B / ... / LXI B,stride / DAD B / POP B / DCR B / JNZ. The pushed
+    // BC is only left on the stack from the last pass. With the mirrors
+    // mapped, addresses are compared as the bytes they are in the first 16K.
+    PASSES(b ? b : 256);
+    int copy = u->op == UOP_COLUMN_COPY;
+    uint16_t src = DE, dst = HL, stride = u->imm;
+    uint16_t s1 = sp - 1, s2 = sp - 2;
+    uint16_t fold = state->mapped ? MIRROR_SIZE - 1 : 0xffff;
+    if (page_flags[s1 >> 8] || page_flags[s2 >> 8])
+      goto bail;
+    for (int i = 0; i < m; i++) {
+      uint16_t to = (dst + i * stride) & fold, from = (src + i) & fold;
+      if (page_flags[(uint16_t) (dst + i * stride) >> 8] ||
+          to == (s1 & fold) || to == (s2 & fold) ||
+          (copy && (from == (s1 & fold) || from == (s2 & fold))))
+        goto bail;
+    }
+    for (int i = 0; i < m; i++) {
+      uint16_t to = dst + i * stride;
+      if (copy)
+        a = RD(src + i);
+      mem[to] = a;
+      dirty[to >> 5] = 1;
+    }
+    b -= m - 1;
+    mem[s1] = b; dirty[s1 >> 5] = 1;
+    mem[s2] = c; dirty[s2 >> 5] = 1;
+    cy = ((uint16_t) (dst + (m - 1) * stride) + stride) >> 16;
+    SETPAIR(h, l, dst + m * stride);
+    if (copy)
+      SETPAIR(d, e, src + m);
+    DCR(b);
+    left -= m * u->cycles;
+    DONE(m, n);
+  }
+
+ op_count: {
+    // A zero byte skips the INR C, so passes differ in length
+    uint16_t at = HL;
+    uint8_t v = 0, found = 0;
+    int n = b ? b : 256, m = 0;
+    left += u->cycles;
+    for (; m < n; m++) {
+      uint8_t next = RD(at + m);
+      int pass = u->cycles - (next ? 0 : Cycles8080[0x0c]);
+      if (pass >= left)
+        break;
+      left -= pass;
+      v = next;
+      found += v != 0;
+    }
+    if (m == 0)
+      goto bail;
+    a = v;
+    cy = 0;
+    c += found;
+    SETPAIR(h, l, at + m);
+    b -= m - 1;
+    DCR(b);
+    DONE(m, n);
+  }
+
+ op_scan: {
+    // A nonzero byte leaves through the first JNZ, part way round
+    int hit = Cycles8080[0x7e] + Cycles8080[0xa7] + Cycles8080[0xc2];
+    uint16_t at = HL;
+    int n = b ? b : 256, m = 0;
+    left += u->cycles;
+    for (; m < n; m++) {
+      uint8_t v = RD(at + m);
+      if (v != 0) {
+        if (hit >= left)
+          break;
+        left -= hit;
+        a = v;
+        ANA8(a);
+        SETPAIR(h, l, at + m);
+        b -= m;
+        pc = u->imm;
+        goto lookup;
+      }
+      if (u->cycles >= left)
+        break;
+      left -= u->cycles;
+    }
+    if (m == 0)
+      goto bail;
+    a = 0;
+    ANA8(a);
+    SETPAIR(h, l, at + m);
+    b -= m - 1;
+    DCR(b);
+    DONE(m, n);
+  }
+
+ op_wait_ana:
+ op_wait_dcr: {
+    // Nothing else can write memory while the loop spins, so every pass
+    // reads the same byte and ends the same way.
+    PASSES(1);
+    a = RD(u->imm);
+    if (u->op == UOP_WAIT_ANA)
+      ANA8(a);
+    else
+      DCR(a);
+    if (a == 0) {
+      left -= u->cycles;
+      DONE(m, n);
+    }
+    left -= (left - 1) / u->cycles * u->cycles;
+    pc = u->pc;
+    goto out;
+  }
+
+#undef PASSES
+#undef DONE
+
+ bail:
+  pc = u->pc;
+  goto out;
+
+ out:
+  state->a = a; state->b = b; state->c = c; state->d = d;
+  state->e = e; state->h = h; state->l = l;
+  state->sp = sp; state->pc = pc;
+  flags.zsp = zsp; flags.aux = aux; flags.cy = cy;
+  LazyFlagsToCC(flags, &state->cc);
+  left += held;
+  if (state->halted && left > 0)
+    left = 0;
+  state->cycles = base + (cycles - left);
+  // Stopped in front of a block that would run past the budget. Under
+  // RunDebug8080, or on a watchpoint, hand back what is left instead.
+  if (left > 0 && !held && !cache->stepping)
+    return Run8080(state, left);
+  return -left;
+}
+
+#undef WR
+#undef WATCH
+#undef SMC
+#undef DEBUG_HOLD
+#undef PC
+#undef IMM8
+#undef IMM16
+#undef NEXT
+#undef JUMP
+#undef NOW
+
+#undef RD
+#undef BC
+#undef DE
+#undef HL
+#undef SETPAIR
+#undef ZSP
+#undef ZF
+#undef SF
+#undef PF
+#undef ADD8
+#undef SUB8
+#undef CMP8
+#undef ANA8
+#undef XRA8
+#undef ORA8
+#undef INR
+#undef DCR
+#undef DAD
+#undef DAA
+#undef PSW_PACK
+#undef PSW_UNPACK
+#undef CALL
+#undef RET
+#undef ON_CALL
+#undef ON_RET
+
+/**
+ * Reference backend with the same interface as Run8080: steps Emulate8080Op
+ * until the cycle budget is spent and returns the overshoot.
+ */
+int RunSwitch8080(State8080 *state, int cycles) {
+  uint64_t until = state->cycles + cycles;
+  if (state->halted) {
+    state->cycles = until;
+    return 0;
+  }
+  while (state->cycles < until && !state->halted) {
+    Emulate8080Op(state);
+  }
+  if (state->halted && state->cycles < until)
+    state->cycles = until;
+  return state->cycles - until;
+}
+
+// Runs a CPU for a cycle budget and returns the overshoot: Run8080 or
+// RunSwitch8080
+typedef int (*Backend8080)(State8080 *state, int cycles);
+
+static uint16_t DebugRegValue(const State8080 *state, DebugReg reg) {
+  switch (reg) {
+  case REG_A:  return state->a;
+  case REG_B:  return state->b;
+  case REG_C:  return state->c;
+  case REG_D:  return state->d;
+  case REG_E:  return state->e;
+  case REG_H:  return state->h;
+  case REG_L:  return state->l;
+  case REG_BC: return state->b << 8 | state->c;
+  case REG_DE: return state->d << 8 | state->e;
+  case REG_HL: return state->h << 8 | state->l;
+  case REG_SP: return state->sp;
+  default:     return 0;
+  }
+}
+
+// Whether a breakpoint at pc has its condition met
+static int DebugBreakHere(const Debugger *debug, const State8080 *state) {
+  for (int i = 0; i < debug->break_count; i++) {
+    const Breakpoint *bp = &debug->breaks[i];
+    if (bp->pc == state->pc &&
+        (bp->reg == REG_NONE || DebugRegValue(state, bp->reg) == bp->value))
+      return 1;
+  }
+  return 0;
+}
+
+/**
+ * The data the instruction at pc is about to read: sets *adr and returns
+ * the number of bytes from there, or returns 0 if it reads none. A
+ * conditional return only reads the stack if it is taken.
+ */
+static int DebugReads(const State8080 *state, uint16_t *adr) {
+  const uint8_t *mem = state->memory;
+  uint8_t op = mem[state->pc];
+  if (op == 0x0a || op == 0x1a) {  // LDAX B, LDAX D
+    *adr = op == 0x0a ? state->b << 8 | state->c : state->d << 8 | state->e;
+    return 1;
+  }
+  if (op == 0x2a || op == 0x3a) {  // LHLD, LDA
+    *adr = mem[(uint16_t) (state->pc + 1)] |
+           mem[(uint16_t) (state->pc + 2)] << 8;
+    return op == 0x2a ? 2 : 1;
+  }
+  // MOV r,M, the arithmetic on M, INR M and DCR M
+  if (((op & 0xc7) == 0x46 && op != 0x76) || (op & 0xc7) == 0x86 ||
+      op == 0x34 || op == 0x35) {
+    *adr = state->h << 8 | state->l;
+    return 1;
+  }
+  if ((op & 0xc7) == 0xc0) {  // Rcc: NZ Z NC C PO PE P M
+    static const uint8_t flag[4] = { FLAG_Z, FLAG_CY, FLAG_P, FLAG_S };
+    uint8_t psw = LazyFlagsPSW(LazyFlagsFromCC(state->cc));
+    if (!(psw & flag[op >> 4 & 3]) != !(op & 0x08))
+      return 0;
+  } else if ((op & 0xcf) != 0xc1 && op != 0xc9 && op != 0xd9 && op != 0xe3) {
+    return 0;  // not POP, RET or XTHL either
+  }
+  *adr = state->sp;
+  return 2;
+}
+
+// Brings the debugger's page flags, and the machine's and the block
+// cache's copies of them, up to date with the lists
+static void DebugRefresh(State8080 *state) {
+  Debugger *debug = state->debug;
+  BlockCache *cache = state->blocks;
+  memset(debug->page, 0, sizeof(debug->page));
+  for (int i = 0; i < debug->break_count; i++)
+    debug->page[debug->breaks[i].pc >> 8] |= DEBUG_EXEC;
+  for (int i = 0; i < debug->watch_count; i++) {
+    const Watchpoint *w = &debug->watches[i];
+    for (int page = w->first >> 8; page <= w->last >> 8; page++)
+      debug->page[page] |= w->kind;
+  }
+  debug->armed = 0;
+  for (int page = 0; page < 256; page++) {
+    debug->armed |= debug->page[page];
+    cache->break_page[page] = debug->page[page] & DEBUG_EXEC;
+    state->page_flags[page] &= ~PAGE_WATCH;
+    if (debug->page[page] & DEBUG_WRITE)
+      state->page_flags[page] |= PAGE_WATCH;
+  }
+  // Blocks decoded before may run through a new breakpoint
+  FlushBlockCache(state);
+}
+
+/**
+ * Gives a machine a debugger, with nothing set, if it has none yet.
+ * Breakpoints and watchpoints only work through RunScheduled8080, which
+ * runs RunDebug8080 whenever one is set.
+ */
+Debugger* DebugAttach(State8080 *state) {
+  if (state->debug == NULL)
+    state->debug = calloc(1, sizeof(Debugger));
+  if (state->blocks == NULL)
+    state->blocks = calloc(1, sizeof(BlockCache));
+  return state->debug;
+}
+
+/**
+ * Stops the machine in front of the instruction at `pc`, if `reg` holds
+ * `value` at the time (any time for REG_NONE). Returns -1 if there are
+ * too many breakpoints already.
+ */
+int DebugAddBreak(State8080 *state, uint16_t pc, DebugReg reg,
+                  uint16_t value) {
+  Debugger *debug = DebugAttach(state);
+  if (debug->break_count == DEBUG_BREAKS)
+    return -1;
+  debug->breaks[debug->break_count++] = (Breakpoint) { pc, reg, value };
+  DebugRefresh(state);
+  return 0;
+}
+
+/**
+ * Stops the machine after an instruction that reads (DEBUG_READ) or writes
+ * (DEBUG_WRITE) any byte from `first` to `last`. Only the CPU's accesses
+ * count, not the host's or the instruction fetch. Returns -1 if there are
+ * too many watchpoints already.
+ */
+int DebugAddWatch(State8080 *state, uint16_t first, uint16_t last,
+                  int kind) {
+  Debugger *debug = DebugAttach(state);
+  if (debug->watch_count == DEBUG_WATCHES || first > last)
+    return -1;
+  debug->watches[debug->watch_count++] = (Watchpoint) { first, last, kind };
+  DebugRefresh(state);
+  return 0;
+}
+
+// Removes every breakpoint and watchpoint
+void DebugClear(State8080 *state) {
+  Debugger *debug = DebugAttach(state);
+  debug->break_count = 0;
+  debug->watch_count = 0;
+  debug->hit.kind = 0;
+  DebugRefresh(state);
+}
+
+/**
+ * Lets a machine that stopped run on. It stays stopped, whatever it is
+ * asked to run, until this is called. Off a breakpoint it first runs the
+ * instruction it stopped in front of.
+ */
+void DebugContinue(State8080 *state) {
+  Debugger *debug = state->debug;
+  debug->skip = debug->hit.kind == DEBUG_EXEC;
+  debug->hit.kind = 0;
+}
+
+/**
+ * Runs `cycles` T-states like the other engines, but stops short on a
+ * breakpoint or watchpoint of state->debug, saying why in debug->hit.
+ * Returns the overshoot, or minus the cycles not run if it stopped.
+ *
+ * Most code still runs at full speed on RunCached8080. Its blocks stop
+ * short of any page with a breakpoint, and a store to a page with a write
+ * watchpoint takes the slow path that stores to pages of cached code
+ * already take. So nothing is checked per instruction except on the
+ * breakpoint pages and in the last few instructions of a slice, which are
+ * stepped one at a time on Run8080. Reads have no slow path, so while a read
+ * watchpoint is set every instruction is stepped.
+ */
+int RunDebug8080(State8080 *state, int cycles) {
+  Debugger *debug = state->debug;
+  BlockCache *cache = state->blocks;
+  uint64_t until = state->cycles + cycles;
+  while (state->cycles < until && debug->hit.kind == 0) {
+    if (state->halted || (!debug->skip && !(debug->armed & DEBUG_READ) &&
+                          !(debug->page[state->pc >> 8] & DEBUG_EXEC))) {
+      uint64_t before = state->cycles;
+      cache->stepping = 1;
+      RunCached8080(state, until - state->cycles);
+      cache->stepping = 0;
+      if (state->cycles != before)
+        continue;
+    }
+    // One instruction, checked
+    if (!debug->skip && (debug->page[state->pc >> 8] & DEBUG_EXEC) &&
+        DebugBreakHere(debug, state)) {
+      debug->hit = (DebugHit) { DEBUG_EXEC, state->pc, 0, 0 };
+      break;
+    }
+    debug->skip = 0;
+    uint16_t pc = state->pc, adr = 0;
+    int n = (debug->armed & DEBUG_READ) ? DebugReads(state, &adr) : 0;
+    Run8080(state, 1);
+    for (int i = 0; i < n && debug->hit.kind == 0; i++) {
+      uint16_t at = adr + i;
+      if (!(debug->page[at >> 8] & DEBUG_READ))
+        continue;
+      for (int k = 0; k < debug->watch_count; k++) {
+        const Watchpoint *w = &debug->watches[k];
+        if ((w->kind & DEBUG_READ) && at >= w->first && at <= w->last) {
+          debug->hit = (DebugHit) { DEBUG_READ, pc, at, state->memory[at] };
+          break;
+        }
+      }
+    }
+  }
+  return state->cycles - until;
+}
+
+/**
+ * Acknowledges interrupt `n` the way the Space Invaders board does it, by
+ * jamming RST n onto the bus: PC is pushed, execution continues at n * 8 and
+ * further interrupts are disabled until the handler runs EI. Does nothing if
+ * interrupts are disabled.
+ */
+void GenerateInterrupt(State8080 *state, int n) {
+  if (!state->int_enable)
+    return;
+  // "PUSH PC"
+  StoreByte(state, state->sp - 1, state->pc >> 8);
+  StoreByte(state, state->sp - 2, state->pc & 0xff);
+  state->sp -= 2;
+  // Set the PC to the low memory vector
+  state->pc = 8 * n;
+  // "DI"
+  state->int_enable = 0;
+  state->halted = 0;
+  state->cycles += Cycles8080[0xc7];
+}
+
+/**
+ * Adds an event firing once state->cycles reaches `when`.
+ */
+void ScheduleEvent(State8080 *state, uint64_t when, EventFn fn, int arg) {
+  Scheduler *sched = &state->sched;
+  if (sched->count == MAX_EVENTS) {
+    printf("error: too many scheduled events\n");
+    exit(1);
+  }
+  // Insertion sort, keeping events with the same cycle in the order they
+  // were added
+  int i = sched->count++;
+  while (i > 0 && sched->events[i - 1].when > when) {
+    sched->events[i] = sched->events[i - 1];
+    i--;
+  }
+  sched->events[i].when = when;
+  sched->events[i].fn = fn;
+  sched->events[i].arg = arg;
+}
+
+/**
+ * Fires, in order, every event that is due by state->cycles.
+ */
+static void FireDueEvents(State8080 *state) {
+  Scheduler *sched = &state->sched;
+  while (sched->count > 0 && sched->events[0].when <= state->cycles) {
+    Event ev = sched->events[0];
+    sched->count--;
+    memmove(&sched->events[0], &sched->events[1],
+            sched->count * sizeof(Event));
+    ev.fn(state, ev.when, ev.arg);
+  }
+}
+
+// Where the slice starting now has to end: `until`, or the next event if
+// that comes first
+static uint64_t SliceEnd(const State8080 *state, uint64_t until) {
+  const Scheduler *sched = &state->sched;
+  if (sched->count > 0 && sched->events[0].when < until)
+    return sched->events[0].when;
+  return until;
+}
+
+/**
+ * Runs `cycles` T-states on `run`, cutting the budget into slices that end
+ * at the next scheduled event and firing events between slices. This is the
+ * only place events (and so interrupts) are looked at; the backends never
+ * poll for them. Returns the overshoot past the budget, or minus the cycles
+ * not run if the machine stopped on a breakpoint.
+ */
+int RunScheduled8080(State8080 *state, Backend8080 run, int cycles) {
+  uint64_t until = state->cycles + cycles;
+  // With any breakpoint set, whatever the engine, and stopping short on one
+  Debugger *debug = state->debug;
+  if (debug != NULL && debug->armed)
+    run = RunDebug8080;
+
+  while (state->cycles < until) {
+    if (debug != NULL && debug->hit.kind != 0)
+      break;
+    uint64_t stop = SliceEnd(state, until);
+    if (stop > state->cycles)
+      run(state, stop - state->cycles);
+    FireDueEvents(state);
+  }
+  return state->cycles - until;
+}
+
+#define FRAME_CYCLES (CPU_HZ / FRAME_HZ)
+
+// The video hardware raises RST 1 when the beam reaches the middle of the
+// screen and RST 2 at the start of vblank, once per frame each.
+static void VideoInterrupt(State8080 *state, uint64_t when, int n) {
+  GenerateInterrupt(state, n);
+  ScheduleEvent(state, when + FRAME_CYCLES, VideoInterrupt, n);
+}
+
+/**
+ * Starts the mid-screen and vblank interrupts, first frame starting now.
+ */
+void InvadersScheduleInterrupts(State8080 *state) {
+  ScheduleEvent(state, state->cycles + HALF_FRAME_CYCLES, VideoInterrupt, 1);
+  ScheduleEvent(state, state->cycles + FRAME_CYCLES, VideoInterrupt, 2);
+}
+
+// The cycle the half frame that `cycles` falls in ends at. Frames start at
+// multiples of FRAME_CYCLES, as the interrupts do when started at reset, so
+// slices run up to these stay on the frame however far each overshoots.
+static uint64_t HalfFrameEnd(uint64_t cycles) {
+  uint64_t mid = cycles - cycles % FRAME_CYCLES + HALF_FRAME_CYCLES;
+  return cycles < mid ? mid : mid - HALF_FRAME_CYCLES + FRAME_CYCLES;
+}
+
+/**
+ * Runs to the end of the current half frame: every machine, on every core
+ * and in every loop, stops between slices at the same cycles, and two
+ * slices make a frame. Returns what RunScheduled8080 does.
+ */
+int RunHalfFrame8080(State8080 *state, Backend8080 run) {
+  return RunScheduled8080(state, run,
+                          HalfFrameEnd(state->cycles) - state->cycles);
+}
+
+static uint8_t PortInNone(State8080 *state, uint8_t port) {
+  (void) state;
+  (void) port;
+  return 0;
+}
+
+static void PortOutNone(State8080 *state, uint8_t port, uint8_t value) {
+  (void) state;
+  (void) port;
+  (void) value;
+}
+
+/**
+ * Returns a port table with nothing attached: IN reads 0, OUT is ignored.
+ * Fill in the ports you need with SetPortIn/SetPortOut.
+ */
+Ports* PortsNew(void) {
+  Ports *ports = malloc(sizeof(Ports));
+  for (int i = 0; i < 256; i++) {
+    ports->in[i] = PortInNone;
+    ports->out[i] = PortOutNone;
+  }
+  return ports;
+}
+
+void SetPortIn(Ports *ports, uint8_t port, PortInFn fn) {
+  ports->in[port] = fn ? fn : PortInNone;
+}
+
+void SetPortOut(Ports *ports, uint8_t port, PortOutFn fn) {
+  ports->out[port] = fn ? fn : PortOutNone;
+}
+
+// Input port bits, active high. Port 0 is mostly unused by Space Invaders.
+#define INPUT_COIN      0x01  // port 1
+#define INPUT_P2_START  0x02  // port 1
+#define INPUT_P1_START  0x04  // port 1
+#define INPUT_SHOT      0x10  // port 1 for player 1, port 2 for player 2
+#define INPUT_LEFT      0x20  // ditto
+#define INPUT_RIGHT     0x40  // ditto
+#define INPUT_TILT      0x04  // port 2
+// Port 2 DIP switches
+#define DIP_SHIPS       0x03  // 3 + this many ships
+#define DIP_EXTRA_SHIP  0x08  // extra ship at 1000 points instead of 1500
+#define DIP_COIN_INFO   0x80  // set to hide the coin info in the demo
+
+// IN 0-2: switches and buttons
+static uint8_t MidwayInput(State8080 *state, uint8_t port) {
+  return state->io.in_port[port];
+}
+
+// IN 3: the shift register, read through a window `shift_offset` bits to
+// the left of its low byte
+static uint8_t MidwayShiftResult(State8080 *state, uint8_t port) {
+  (void) port;
+  return state->io.shift >> (8 - state->io.shift_offset);
+}
+
+// OUT 2: shift amount, 0-7
+static void MidwayShiftOffset(State8080 *state, uint8_t port, uint8_t value) {
+  (void) port;
+  state->io.shift_offset = value & 7;
+}
+
+// OUT 4: shift data. The new byte goes into the high half and the previous
+// one drops to the low half.
+static void MidwayShiftData(State8080 *state, uint8_t port, uint8_t value) {
+  (void) port;
+  state->io.shift = (value << 8) | (state->io.shift >> 8);
+}
+
+/**
+ * A write to sound port 3 or 5 that changed it, stamped with the cycle it
+ * happened at. Port 0 is a tick from the host instead: emulated time has
+ * got to `cycle`, as of `wall` on the host's monotonic clock.
+ */
+typedef struct SoundEvent {
+  uint64_t  cycle;
+  double    wall;
+  uint8_t   port;
+  uint8_t   value;
+} SoundEvent;
+
+#define SOUND_RING_SIZE 4096  // events, a power of two
+
+/**
+ * Single-producer, single-consumer queue of sound events from the CPU's
+ * thread to the mixer's. Each index is only stored by its own side, so a
+ * push is a load, a store and a release, and nobody waits: when the ring is
+ * full the CPU drops the event rather than wait for the mixer.
+ */
+typedef struct SoundRing {
+  _Alignas(64) _Atomic uint32_t head;  // next slot to fill, the CPU's
+  uint64_t  dropped;                   // events that found the ring full
+  _Alignas(64) _Atomic uint32_t tail;  // next slot to drain, the mixer's
+  SoundEvent events[SOUND_RING_SIZE];
+} SoundRing;
+
+static void SoundPush(SoundRing *ring, uint64_t cycle, double wall,
+                      uint8_t port, uint8_t value) {
+  uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) ==
+      SOUND_RING_SIZE) {
+    ring->dropped++;
+    return;
+  }
+  ring->events[head & (SOUND_RING_SIZE - 1)] =
+    (SoundEvent) { cycle, wall, port, value };
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// OUT 3 and 5: sound triggers, latched so the host can see what is playing,
+// and passed on to the mixer when they change
+static void MidwaySound(State8080 *state, uint8_t port, uint8_t value) {
+  uint8_t *latch = &state->io.sound[port == 5];
+  if (state->sound != NULL && *latch != value)
+    SoundPush(state->sound, state->cycles, 0, port, value);
+  *latch = value;
+}
+
+/**
+ * Port table for the Midway 8080 board (Space Invaders and friends). It is
+ * built once and shared, the per-machine state lives in State8080.io. Port
+ * 6 is the watchdog, which is left unconnected.
+ */
+static Ports *midway_ports;
+
+static void MidwayPortsInit(void) {
+  Ports *p = PortsNew();
+  SetPortIn(p, 0, MidwayInput);
+  SetPortIn(p, 1, MidwayInput);
+  SetPortIn(p, 2, MidwayInput);
+  SetPortIn(p, 3, MidwayShiftResult);
+  SetPortOut(p, 2, MidwayShiftOffset);
+  SetPortOut(p, 3, MidwaySound);
+  SetPortOut(p, 4, MidwayShiftData);
+  SetPortOut(p, 5, MidwaySound);
+  midway_ports = p;
+}
+
+const Ports* MidwayPorts(void) {
+  // Machines may be set up from several threads at once
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, MidwayPortsInit);
+  return midway_ports;
+}
+
+// Stores to the ROM, or to any of its mirrors, go nowhere
+static void MidwayRomWrite(State8080 *state, uint16_t adr, uint8_t value) {
+  (void) state;
+  (void) adr;
+  (void) value;
+}
+
+// A store to a mirror of the RAM. The MMU shows the same bytes at 2000-3FFF,
+// so storing there too changes nothing; but it marks the right column of the
+// screen dirty and drops blocks decoded from the page, whichever address
+// they were decoded at. Without the MMU's mirror it at least keeps both
+// addresses up to date.
+static void MidwayMirrorWrite(State8080 *state, uint16_t adr, uint8_t value) {
+  state->memory[adr] = value;
+  WriteByte(state, adr & (MIRROR_SIZE - 1), value);
+}
+
+/**
+ * Memory map for the Midway 8080 board: RAM at 2000-3FFF is the only page
+ * the CPU stores straight into; the ROM is read-only and the mirrors above
+ * 3FFF go through MidwayMirrorWrite. Built once and shared, like the ports.
+ */
+static MemoryMap *midway_map;
+
+static void MidwayMapInit(void) {
+  MemoryMap *map = calloc(1, sizeof(MemoryMap));
+  map->page_mask = (MIRROR_SIZE >> 8) - 1;
+  for (int page = 0; page < 256; page++) {
+    if ((page & map->page_mask) < ROM_SIZE >> 8)
+      map->write[page] = MidwayRomWrite;
+    else if (page >= MIRROR_SIZE >> 8)
+      map->write[page] = MidwayMirrorWrite;
+  }
+  midway_map = map;
+}
+
+const MemoryMap* MidwayMemoryMap(void) {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, MidwayMapInit);
+  return midway_map;
+}
+
+/**
+ * Resets the Midway board I/O to power-on values: no buttons pressed, 3
+ * ships, and the bits the board always reads as 1 set.
+ */
+void MidwayResetIO(MidwayIO *io) {
+  memset(io, 0, sizeof(MidwayIO));
+  io->in_port[0] = 0x0e;
+  io->in_port[1] = 0x08;
+}
+
+// The screen is 224x256 once rotated upright. Video RAM holds it as 224
+// columns of 32 bytes, each column running bottom to top with bit 0 of a
+// byte being the lowest of its 8 pixels, because the monitor is mounted on
+// its side.
+#define SCREEN_WIDTH    224
+#define SCREEN_HEIGHT   256
+#define VRAM_START      0x2400
+#define VRAM_SIZE       (SCREEN_WIDTH * 32)
+
+// The converters work on strips of 16 columns, the width of an SSE2 register
+#define STRIP_WIDTH     16
+#define STRIP_COUNT     (SCREEN_WIDTH / STRIP_WIDTH)
+
+// Colours of the cabinet's overlay, which is cellophane on the glass in front
+// of a black and white monitor. 8-bit frames hold these indices, RGBA frames
+// the colours from OverlayPalette.
+#define OVERLAY_BLACK   0
+#define OVERLAY_WHITE   1
+#define OVERLAY_RED     2
+#define OVERLAY_GREEN   3
+
+// As RGBA bytes in memory, i.e. 0xAABBGGRR when read as a little-endian word
+const uint32_t OverlayPalette[4] = {
+  0xff000000, 0xffffffff, 0xff0000ff, 0xff00ff00,
+};
+
+// The overlay comes in four kinds of row: plain white, the red band over the
+// UFO, the green band over the shields and the player, and the bottom line,
+// green only over the reserve ships.
+static const uint8_t OverlayRowKind[SCREEN_HEIGHT] = {
+  [0 ... 31] = 0, [32 ... 63] = 1, [64 ... 183] = 0, [184 ... 239] = 2,
+  [240 ... 255] = 3,
+};
+
+static const uint8_t OverlayIndex[4][SCREEN_WIDTH]
+    __attribute__((aligned(16))) = {
+  { [0 ... 223] = OVERLAY_WHITE },
+  { [0 ... 223] = OVERLAY_RED },
+  { [0 ... 223] = OVERLAY_GREEN },
+  { [0 ... 15] = OVERLAY_WHITE, [16 ... 133] = OVERLAY_GREEN,
+    [134 ... 223] = OVERLAY_WHITE },
+};
+
+static const uint32_t OverlayRGBA[4][SCREEN_WIDTH]
+    __attribute__((aligned(32))) = {
+  { [0 ... 223] = 0xffffffff },
+  { [0 ... 223] = 0xff0000ff },
+  { [0 ... 223] = 0xff00ff00 },
+  { [0 ... 15] = 0xffffffff, [16 ... 133] = 0xff00ff00,
+    [134 ... 223] = 0xffffffff },
+};
+
+#if !defined(__SSE2__)
+/**
+ * Scalar converter for one strip, used where there is no SSE2. Exactly one
+ * of out8 and out32 is non-NULL.
+ */
+static void RenderStripScalar(const uint8_t *vram, int strip,
+                              uint8_t *out8, uint32_t *out32) {
+  for (int x = strip * STRIP_WIDTH; x < (strip + 1) * STRIP_WIDTH; x++) {
+    const uint8_t *column = &vram[x * 32];
+    for (int yr = 0; yr < SCREEN_HEIGHT; yr++) {
+      int y = SCREEN_HEIGHT - 1 - yr;
+      int on = (column[yr >> 3] >> (yr & 7)) & 1;
+      if (out8)
+        out8[y * SCREEN_WIDTH + x] =
+          on ? OverlayIndex[OverlayRowKind[y]][x] : 0;
+      else
+        out32[y * SCREEN_WIDTH + x] =
+          on ? OverlayRGBA[OverlayRowKind[y]][x]
+             : OverlayPalette[OVERLAY_BLACK];
+    }
+  }
+}
+#endif
+
+#if defined(__SSE2__)
+/**
+ * Transposes a 16x16 byte matrix held one row per register. Four rounds of
+ * interleaving row i with row i + 8 do it.
+ */
+static inline __attribute__((always_inline))
+void Transpose16x16(__m128i r[16]) {
+  for (int round = 0; round < 4; round++) {
+    __m128i t[16];
+    for (int i = 0; i < 8; i++) {
+      t[2 * i] = _mm_unpacklo_epi8(r[i], r[i + 8]);
+      t[2 * i + 1] = _mm_unpackhi_epi8(r[i], r[i + 8]);
+    }
+    for (int i = 0; i < 16; i++)
+      r[i] = t[i];
+  }
+}
+
+/**
+ * Loads a strip of 16 columns and turns it sideways, so that rows[k] holds
+ * byte k of each of the 16 columns. Bit b of rows[k] is then screen row
+ * 255 - (8k + b) for those 16 pixels.
+ */
+static inline __attribute__((always_inline))
+void LoadStrip(const uint8_t *vram, int strip, __m128i rows[32]) {
+  const uint8_t *base = &vram[strip * STRIP_WIDTH * 32];
+  for (int half = 0; half < 2; half++) {
+    __m128i *r = &rows[half * 16];
+    for (int i = 0; i < 16; i++)
+      r[i] = _mm_loadu_si128((const __m128i *) &base[i * 32 + half * 16]);
+    Transpose16x16(r);
+  }
+}
+
+static void RenderStrip8SSE2(const uint8_t *vram, int strip, uint8_t *out) {
+  __m128i rows[32];
+  int x = strip * STRIP_WIDTH;
+  LoadStrip(vram, strip, rows);
+  for (int k = 0; k < 32; k++) {
+    for (int b = 0; b < 8; b++) {
+      int y = SCREEN_HEIGHT - 1 - (8 * k + b);
+      __m128i bit = _mm_set1_epi8(1 << b);
+      __m128i on = _mm_cmpeq_epi8(_mm_and_si128(rows[k], bit), bit);
+      __m128i colour = _mm_load_si128(
+        (const __m128i *) &OverlayIndex[OverlayRowKind[y]][x]);
+      _mm_storeu_si128((__m128i *) &out[y * SCREEN_WIDTH + x],
+                       _mm_and_si128(on, colour));
+    }
+  }
+}
+
+static void RenderStripRGBASSE2(const uint8_t *vram, int strip, uint32_t *out) {
+  __m128i rows[32];
+  int x = strip * STRIP_WIDTH;
+  __m128i black = _mm_set1_epi32(OverlayPalette[OVERLAY_BLACK]);
+  LoadStrip(vram, strip, rows);
+  for (int k = 0; k < 32; k++) {
+    for (int b = 0; b < 8; b++) {
+      int y = SCREEN_HEIGHT - 1 - (8 * k + b);
+      __m128i bit = _mm_set1_epi8(1 << b);
+      __m128i on = _mm_cmpeq_epi8(_mm_and_si128(rows[k], bit), bit);
+      // Widen each 0x00/0xff byte to a 32-bit mask
+      __m128i lo = _mm_unpacklo_epi8(on, on), hi = _mm_unpackhi_epi8(on, on);
+      __m128i m[4] = {
+        _mm_unpacklo_epi16(lo, lo), _mm_unpackhi_epi16(lo, lo),
+        _mm_unpacklo_epi16(hi, hi), _mm_unpackhi_epi16(hi, hi),
+      };
+      const uint32_t *colour = &OverlayRGBA[OverlayRowKind[y]][x];
+      uint32_t *dst = &out[y * SCREEN_WIDTH + x];
+      for (int i = 0; i < 4; i++) {
+        __m128i c = _mm_load_si128((const __m128i *) &colour[i * 4]);
+        _mm_storeu_si128((__m128i *) &dst[i * 4],
+                         _mm_or_si128(_mm_and_si128(m[i], c), black));
+      }
+    }
+  }
+}
+
+#if defined(__GNUC__)
+#define HAVE_AVX2_RENDER 1
+/**
+ * Same as RenderStripRGBASSE2 but widens the masks with vpmovsxbd and
+ * stores 8 pixels at a time.
+ */
+__attribute__((target("avx2")))
+static void RenderStripRGBAAVX2(const uint8_t *vram, int strip, uint32_t *out) {
+  __m128i rows[32];
+  int x = strip * STRIP_WIDTH;
+  __m256i black = _mm256_set1_epi32(OverlayPalette[OVERLAY_BLACK]);
+  LoadStrip(vram, strip, rows);
+  for (int k = 0; k < 32; k++) {
+    for (int b = 0; b < 8; b++) {
+      int y = SCREEN_HEIGHT - 1 - (8 * k + b);
+      __m128i bit = _mm_set1_epi8(1 << b);
+      __m128i on = _mm_cmpeq_epi8(_mm_and_si128(rows[k], bit), bit);
+      __m256i m0 = _mm256_cvtepi8_epi32(on);
+      __m256i m1 = _mm256_cvtepi8_epi32(_mm_srli_si128(on, 8));
+      const uint32_t *colour = &OverlayRGBA[OverlayRowKind[y]][x];
+      uint32_t *dst = &out[y * SCREEN_WIDTH + x];
+      __m256i c0 = _mm256_load_si256((const __m256i *) &colour[0]);
+      __m256i c1 = _mm256_load_si256((const __m256i *) &colour[8]);
+      _mm256_storeu_si256((__m256i *) &dst[0],
+                          _mm256_or_si256(_mm256_and_si256(m0, c0), black));
+      _mm256_storeu_si256((__m256i *) &dst[8],
+                          _mm256_or_si256(_mm256_and_si256(m1, c1), black));
+    }
+  }
+}
+#endif
+#endif
+
+/**
+ * Converts strips [first, last) of video RAM into an 8-bit frame of
+ * SCREEN_WIDTH x SCREEN_HEIGHT overlay indices, top row first. `vram` points
+ * at VRAM_START.
+ */
+void RenderStrips8(const uint8_t *vram, uint8_t *out, int first, int last) {
+  for (int strip = first; strip < last; strip++) {
+#if defined(__SSE2__)
+    RenderStrip8SSE2(vram, strip, out);
+#else
+    RenderStripScalar(vram, strip, out, NULL);
+#endif
+  }
+}
+
+/**
+ * Converts strips [first, last) of video RAM into an RGBA frame, with the
+ * overlay colours applied.
+ */
+void RenderStripsRGBA(const uint8_t *vram, uint32_t *out, int first, int last) {
+#if defined(HAVE_AVX2_RENDER)
+  if (__builtin_cpu_supports("avx2")) {
+    for (int strip = first; strip < last; strip++)
+      RenderStripRGBAAVX2(vram, strip, out);
+    return;
+  }
+#endif
+  for (int strip = first; strip < last; strip++) {
+#if defined(__SSE2__)
+    RenderStripRGBASSE2(vram, strip, out);
+#else
+    RenderStripScalar(vram, strip, NULL, out);
+#endif
+  }
+}
+
+void RenderFrame8(const uint8_t *vram, uint8_t *out) {
+  RenderStrips8(vram, out, 0, STRIP_COUNT);
+}
+
+void RenderFrameRGBA(const uint8_t *vram, uint32_t *out) {
+  RenderStripsRGBA(vram, out, 0, STRIP_COUNT);
+}
+
+// Where the screen's columns sit in State8080.dirty
+#define VRAM_DIRTY_FIRST (VRAM_START >> 5)
+
+/**
+ * Returns a bitmask of the strips (bit n for strip n) with a column written
+ * since the last call, and clears the marks for video RAM. A frame exporter
+ * that gets 0 back can skip the frame altogether.
+ */
+uint32_t TakeDirtyStrips(State8080 *state) {
+  // The 16 column marks of a strip are checked as two words
+  const uint8_t *marks = &state->dirty[VRAM_DIRTY_FIRST];
+  uint32_t strips = 0;
+  for (int strip = 0; strip < STRIP_COUNT; strip++) {
+    uint64_t lo, hi;
+    memcpy(&lo, &marks[strip * STRIP_WIDTH], 8);
+    memcpy(&hi, &marks[strip * STRIP_WIDTH + 8], 8);
+    if (lo | hi)
+      strips |= 1u << strip;
+  }
+  memset(&state->dirty[VRAM_DIRTY_FIRST], 0, SCREEN_WIDTH);
+  return strips;
+}
+
+/**
+ * Brings an 8-bit frame up to date by converting only the strips written
+ * since the last call. `out` must hold the previous frame, or be rendered in
+ * full first. Returns the number of strips redone, 0 if the frame is
+ * unchanged.
+ */
+int RenderDirtyFrame8(State8080 *state, uint8_t *out) {
+  uint32_t strips = TakeDirtyStrips(state);
+  int redone = 0;
+  while (strips) {
+    int first = __builtin_ctz(strips), last = first;
+    // Convert runs of neighbouring strips in one call
+    while (last < STRIP_COUNT && (strips >> last) & 1)
+      last++;
+    RenderStrips8(&state->memory[VRAM_START], out, first, last);
+    strips &= ~((1u << last) - 1);
+    redone += last - first;
+  }
+  return redone;
+}
+
+// Converts the strips in the mask `strips` into an RGBA frame, and
+// returns how many there were
+static int RenderStripSetRGBA(const uint8_t *vram, uint32_t *out,
+                              uint32_t strips) {
+  int redone = 0;
+  while (strips) {
+    int first = __builtin_ctz(strips), last = first;
+    while (last < STRIP_COUNT && (strips >> last) & 1)
+      last++;
+    RenderStripsRGBA(vram, out, first, last);
+    strips &= ~((1u << last) - 1);
+    redone += last - first;
+  }
+  return redone;
+}
+
+/**
+ * RGBA version of RenderDirtyFrame8.
+ */
+int RenderDirtyFrameRGBA(State8080 *state, uint32_t *out) {
+  return RenderStripSetRGBA(&state->memory[VRAM_START], out,
+                            TakeDirtyStrips(state));
+}
+
+// Appends an RGBA frame to `f` as a binary PPM image
+static void PutFramePPM(FILE *f, const uint32_t *frame) {
+  uint8_t row[SCREEN_WIDTH * 3];
+  fprintf(f, "P6\n%d %d\n255\n", SCREEN_WIDTH, SCREEN_HEIGHT);
+  for (int y = 0; y < SCREEN_HEIGHT; y++) {
+    for (int x = 0; x < SCREEN_WIDTH; x++) {
+      uint32_t c = frame[y * SCREEN_WIDTH + x];
+      row[3 * x] = c & 0xff;
+      row[3 * x + 1] = (c >> 8) & 0xff;
+      row[3 * x + 2] = (c >> 16) & 0xff;
+    }
+    fwrite(row, 1, sizeof(row), f);
+  }
+}
+
+/**
+ * Writes an RGBA frame as a binary PPM, which most image viewers open.
+ */
+int WriteFramePPM(const char *filename, const uint32_t *frame) {
+  FILE *f = fopen(filename, "wb");
+  if (f == NULL) {
+    printf("error: Couldn't open %s\n", filename);
+    return -1;
+  }
+  PutFramePPM(f, frame);
+  fclose(f);
+  return 0;
+}
+
+/**
+ * Wires a machine's memory to `map`. Any blocks decoded so far are dropped,
+ * as the new map may mirror pages the old one did not.
+ */
+void SetMemoryMap8080(State8080 *state, const MemoryMap *map) {
+  state->map = map;
+  for (int page = 0; page < 256; page++) {
+    state->page_flags[page] &= ~PAGE_HANDLER;
+    if (map->write[page] != NULL)
+      state->page_flags[page] |= PAGE_HANDLER;
+  }
+  FlushBlockCache(state);
+}
+
+/**
+ * Makes a machine's 64K address space the way the board decodes it: one
+ * 16K file of ROM and RAM, mapped by the MMU at 0000 and again at each
+ * mirror, so that any address is still one indexed load away and a store
+ * at one shows at the others. The ROM is only protected from the CPU by
+ * the memory map, so the host can load it in place. Returns NULL where
+ * this cannot be done, and then the caller uses 64K from malloc, which
+ * does not mirror.
+ */
+static uint8_t* MapMemory8080(void) {
+#if defined(__linux__)
+  int fd = memfd_create("8080-memory", 0);
+  if (fd < 0)
+    return NULL;
+  uint8_t *memory = MAP_FAILED;
+  if (ftruncate(fd, MIRROR_SIZE) == 0)
+    memory = mmap(NULL, 0x10000, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  int ok = memory != MAP_FAILED;
+  for (int mirror = 0; ok && mirror < 0x10000; mirror += MIRROR_SIZE)
+    ok = mmap(memory + mirror, MIRROR_SIZE, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED;
+  // The mappings hold on to the file
+  close(fd);
+  if (!ok) {
+    if (memory != MAP_FAILED)
+      munmap(memory, 0x10000);
+    return NULL;
+  }
+  return memory;
+#else
+  return NULL;
+#endif
+}
+
+State8080* Init8080(void) {
+  State8080* state = calloc(1, sizeof(State8080));
+  state->memory = MapMemory8080();
+  state->mapped = state->memory != NULL;
+  if (!state->mapped)
+    state->memory = malloc(0x10000);
+  SetMemoryMap8080(state, MidwayMemoryMap());
+  state->ports = MidwayPorts();
+  MidwayResetIO(&state->io);
+  return state;
+}
+
+// Clone8080, but with `memory` as the copy's memory, already filled in.
+// `mapped` says whether its RAM appears again at each mirror.
+static State8080* CloneWithMemory8080(const State8080 *state,
+                                      uint8_t *memory, int mapped) {
+  State8080 *copy = malloc(sizeof(State8080));
+  *copy = *state;
+  copy->memory = memory;
+  copy->blocks = NULL;
+  copy->trace = NULL;
+  copy->profile = NULL;
+  copy->debug = NULL;
+  copy->pool = NULL;
+  copy->mapped = mapped;
+  copy->sound = NULL;
+  // No blocks and no watchpoints yet
+  for (int page = 0; page < 256; page++)
+    copy->page_flags[page] &= PAGE_HANDLER;
+  return copy;
+}
+
+/**
+ * Makes an independent copy of a machine, memory and pending events
+ * included, e.g. to start many machines from one that has loaded its ROMs.
+ * The copy gets its own block cache when it first needs one, and no trace.
+ */
+State8080* Clone8080(const State8080 *state) {
+  uint8_t *memory = MapMemory8080();
+  State8080 *copy = CloneWithMemory8080(state,
+                                        memory ? memory : malloc(0x10000),
+                                        memory != NULL);
+  // With the mirrors mapped, the first 16K is all there is to copy
+  memcpy(copy->memory, state->memory, memory ? MIRROR_SIZE : 0x10000);
+  return copy;
+}
+
+static void MemoryPoolGive(struct MemoryPool *pool, uint8_t *window);
+
+void Free8080(State8080 *state) {
+  if (state->pool != NULL)
+    MemoryPoolGive(state->pool, state->memory);
+#if defined(__linux__)
+  else if (state->mapped)
+    munmap(state->memory, 0x10000);
+#endif
+  else
+    free(state->memory);
+  free(state->blocks);
+  TraceRingFree(state->trace);
+  free(state->profile);
+  free(state->debug);
+  free(state);
+}
+
+/**
+ * The address spaces of many machines that share one ROM. Each machine
+ * gets a 64K window, so every engine can still index memory with a plain
+ * uint16_t, but the pages in the window are mapped by the MMU: the ROM from
+ * one copy for all of them, and the machine's own 8K of RAM at 2000 and
+ * again at each mirror. A machine costs 8K of RAM instead of 64K.
+ *
+ * The ROM is mapped copy-on-write. The memory map keeps the CPU from
+ * writing it, but if the host does, that machine gets a private copy of
+ * the page alone, as it would with its own 64K. Such a write does not show
+ * in the ROM's mirrors.
+ *
+ * Each window takes 8 mappings, so vm.max_map_count (65530 by default)
+ * sets the limit at about 8000 machines per process.
+ */
+typedef struct MemoryPool {
+  // `count` windows one after the other, then a page of zeros for reads
+  // that run off the end
+  uint8_t    *windows;
+  size_t      size;
+  int         count;
+  // The ROM as the pool was made with it, which no window's writes reach
+  const uint8_t *rom;
+  // Windows not in use, a stack with the lowest on top. Not thread-safe:
+  // take and give back windows from one thread.
+  int        *free_slots;
+  int         free_count;
+} MemoryPool;
+
+/**
+ * Makes windows for `count` machines whose ROM and RAM start out as
+ * `model`'s. Returns NULL where this cannot be done, and then the caller
+ * gives each machine its own 64K as before.
+ */
+MemoryPool* MemoryPoolNew(const uint8_t *model, int count) {
+#if defined(__linux__)
+  // The ROM, then each machine's RAM
+  size_t bytes = ROM_SIZE + (size_t) count * RAM_SIZE;
+  int fd = memfd_create("8080-memory", 0);
+  if (fd < 0)
+    return NULL;
+  if (ftruncate(fd, bytes) < 0) {
+    close(fd);
+    return NULL;
+  }
+  uint8_t *file = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (file == MAP_FAILED) {
+    close(fd);
+    return NULL;
+  }
+  memcpy(file, model, ROM_SIZE);
+  for (int i = 0; i < count; i++)
+    memcpy(&file[ROM_SIZE + (size_t) i * RAM_SIZE], &model[ROM_SIZE], RAM_SIZE);
+  munmap(file, bytes);
+
+  // Reserve every window in one go, then map over it
+  size_t size = ((size_t) count << 16) + sysconf(_SC_PAGESIZE);
+  uint8_t *windows = mmap(NULL, size, PROT_READ,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  int ok = windows != MAP_FAILED;
+  for (int i = 0; ok && i < count; i++) {
+    off_t ram = ROM_SIZE + (off_t) i * RAM_SIZE;
+    for (int mirror = 0; ok && mirror < 0x10000; mirror += MIRROR_SIZE) {
+      uint8_t *at = &windows[((size_t) i << 16) + mirror];
+      ok = mmap(at, ROM_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED &&
+           mmap(at + ROM_SIZE, RAM_SIZE, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED, fd, ram) != MAP_FAILED;
+    }
+  }
+  uint8_t *rom = mmap(NULL, ROM_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+  // The mappings hold on to the file
+  close(fd);
+  if (!ok || rom == MAP_FAILED) {
+    if (windows != MAP_FAILED)
+      munmap(windows, size);
+    if (rom != MAP_FAILED)
+      munmap(rom, ROM_SIZE);
+    return NULL;
+  }
+  MemoryPool *pool = malloc(sizeof(MemoryPool));
+  pool->windows = windows;
+  pool->size = size;
+  pool->count = count;
+  pool->rom = rom;
+  pool->free_slots = malloc(count * sizeof(int));
+  pool->free_count = count;
+  for (int k = 0; k < count; k++)
+    pool->free_slots[k] = count - 1 - k;
+  return pool;
+#else
+  (void) model;
+  (void) count;
+  return NULL;
+#endif
+}
+
+/**
+ * Takes a window that is not in use, or returns NULL if there are none. A
+ * new pool hands out its windows in order, one after the other.
+ */
+uint8_t* MemoryPoolTake(MemoryPool *pool) {
+  if (pool->free_count == 0)
+    return NULL;
+  int slot = pool->free_slots[--pool->free_count];
+  return &pool->windows[(size_t) slot << 16];
+}
+
+// Puts a window back. Its RAM keeps whatever the last machine left there.
+static void MemoryPoolGive(MemoryPool *pool, uint8_t *window) {
+  pool->free_slots[pool->free_count++] = (window - pool->windows) >> 16;
+}
+
+void MemoryPoolFree(MemoryPool *pool) {
+  if (pool == NULL)
+    return;
+#if defined(__linux__)
+  munmap(pool->windows, pool->size);
+  munmap((void *) pool->rom, ROM_SIZE);
+#endif
+  free(pool->free_slots);
+  free(pool);
+}
+
+/**
+ * Makes a machine that carries on from where `state` is now, on its own.
+ * With a pool the copy takes one of its windows, shares the pool's ROM and
+ * gets a copy of just the 8K of RAM, which takes well under a microsecond.
+ * Without one, or once the pool is used up, or if `state` has written to
+ * its ROM, the copy gets its own 64K as with Clone8080.
+ */
+State8080* Fork8080(const State8080 *state, MemoryPool *pool) {
+  uint8_t *window = NULL;
+  // Even a machine from this pool may have a private copy of a ROM page
+  if (pool != NULL && memcmp(pool->rom, state->memory, ROM_SIZE) == 0)
+    window = MemoryPoolTake(pool);
+  if (window == NULL)
+    return Clone8080(state);
+  State8080 *copy = CloneWithMemory8080(state, window, 1);
+  memcpy(&window[ROM_SIZE], &state->memory[ROM_SIZE], RAM_SIZE);
+  copy->pool = pool;
+  return copy;
+}
+
+/**
+ * The ROM sets this board can run: for each file, where it goes in the
+ * address space, its size and its CRC-32, so that a missing, truncated or
+ * corrupted dump is caught before it runs. A set must fill 0000-1FFF, the
+ * part of the address space that RomHash covers.
+ */
+#define ROMSET_MAX_FILES 8
+
+typedef struct RomFile {
+  const char *name;
+  uint16_t    address;
+  uint16_t    size;
+  uint32_t    crc32;
+} RomFile;
+
+typedef struct RomManifest {
+  const char *name;     // as given to --romset
+  const char *title;
+  int         count;
+  RomFile     files[ROMSET_MAX_FILES];
+} RomManifest;
+
+static const RomManifest RomManifests[] = {
+  { "invaders", "Space Invaders (Midway)", 4, {
+      { "invaders.h", 0x0000, 0x800, 0x734f5ad8 },
+      { "invaders.g", 0x0800, 0x800, 0x6bfaca4a },
+      { "invaders.f", 0x1000, 0x800, 0x0ccead96 },
+      { "invaders.e", 0x1800, 0x800, 0x14e538b0 },
+    } },
+};
+#define ROM_MANIFESTS (int) (sizeof(RomManifests) / sizeof(RomManifest))
+
+// A manifest's files, mapped read-only. Opened once per process and never
+// unmapped, so every machine can load from it without touching the files.
+typedef struct RomSet {
+  const RomManifest *manifest;
+  const uint8_t     *data[ROMSET_MAX_FILES];
+} RomSet;
+
+// Bitwise CRC-32 (the zip one), which is plenty for 8K once per process
+static uint32_t Crc32(const uint8_t *p, size_t size) {
+  uint32_t crc = 0xffffffff;
+  for (size_t i = 0; i < size; i++) {
+    crc ^= p[i];
+    for (int bit = 0; bit < 8; bit++)
+      crc = crc >> 1 ^ (0xedb88320 & -(crc & 1));
+  }
+  return ~crc;
+}
+
+// Maps `file` from `dir` and checks it against the manifest, or returns NULL
+static const uint8_t* MapRomFile(const char *dir, const RomFile *file) {
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/%s", dir, file->name);
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    printf("error: Couldn't open %s\n", path);
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size != file->size) {
+    printf("error: %s should be %d bytes\n", path, file->size);
+    close(fd);
+    return NULL;
+  }
+  uint8_t *data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    printf("error: Couldn't map %s\n", path);
+    return NULL;
+  }
+  uint32_t crc = Crc32(data, file->size);
+  if (crc != file->crc32) {
+    printf("error: %s has CRC-32 %08x, not %08x\n", path, crc, file->crc32);
+    munmap(data, file->size);
+    return NULL;
+  }
+  return data;
+}
+
+/**
+ * Returns the ROM set `name` from RomManifests with its files mapped from
+ * `dir`, or NULL after saying what is wrong. A set is opened only once per
+ * process: later calls, from any thread, get the same one back whatever
+ * `dir` they give.
+ */
+const RomSet* RomSetOpen(const char *name, const char *dir) {
+  static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  static RomSet *opened[ROM_MANIFESTS];
+  int m = 0;
+  while (m < ROM_MANIFESTS && strcmp(RomManifests[m].name, name) != 0)
+    m++;
+  if (m == ROM_MANIFESTS) {
+    printf("error: Unknown ROM set %s, the choices are:\n", name);
+    for (int k = 0; k < ROM_MANIFESTS; k++)
+      printf("  %-10s %s\n", RomManifests[k].name, RomManifests[k].title);
+    return NULL;
+  }
+  pthread_mutex_lock(&lock);
+  if (opened[m] == NULL) {
+    const RomManifest *manifest = &RomManifests[m];
+    RomSet *set = calloc(1, sizeof(RomSet));
+    set->manifest = manifest;
+    int ok = 1;
+    for (int i = 0; i < manifest->count; i++)
+      ok &= (set->data[i] = MapRomFile(dir, &manifest->files[i])) != NULL;
+    if (ok) {
+      opened[m] = set;
+    } else {
+      for (int i = 0; i < manifest->count; i++)
+        if (set->data[i] != NULL)
+          munmap((void *) set->data[i], manifest->files[i].size);
+      free(set);
+    }
+  }
+  RomSet *set = opened[m];
+  pthread_mutex_unlock(&lock);
+  return set;
+}
+
+/**
+ * Copies the ROMs into the machine's memory. Do it before taking snapshots
+ * or making copies of the machine, which then share this ROM.
+ */
+void LoadRomSet(State8080 *state, const RomSet *set) {
+  const RomManifest *manifest = set->manifest;
+  for (int i = 0; i < manifest->count; i++)
+    memcpy(&state->memory[manifest->files[i].address], set->data[i],
+           manifest->files[i].size);
+  FlushBlockCache(state);
+}
+
+/*
+ * A snapshot is a little-endian byte string:
+ *
+ *   "8080"                  magic
+ *   u16 version             SNAPSHOT_VERSION
+ *   u32 ROM hash            RomHash of 0000-1FFF, checked on restore
+ *   u8  A B C D E H L
+ *   u16 SP PC
+ *   u8  PSW                 S Z 0 AC 0 P 1 CY
+ *   u8  int_enable halted fault
+ *   u64 cycles
+ *   u16 shift, u8 shift offset, u8 in ports 0-2, u8 sound ports 3 and 5
+ *   u8  event count, then for each: u64 when, u8 SnapshotEvents index,
+ *       i32 arg
+ *   8K  RAM from 2000
+ *
+ * The ROM is not saved: a snapshot can only go back into a machine that
+ * has the same ROMs loaded. Anything past the RAM is a mirror of it.
+ */
+#define SNAPSHOT_VERSION 1
+// Up to and including the event count
+#define SNAPSHOT_HEADER_SIZE 42
+#define SNAPSHOT_EVENT_SIZE  13
+#define SNAPSHOT_SIZE \
+  (SNAPSHOT_HEADER_SIZE + MAX_EVENTS * SNAPSHOT_EVENT_SIZE + RAM_SIZE)
+
+// Events a snapshot can hold, saved as an index into this table
+static const EventFn SnapshotEvents[] = { VideoInterrupt };
+#define SNAPSHOT_EVENTS (int) (sizeof(SnapshotEvents) / sizeof(EventFn))
+
+// A Fletcher-style pair of sums, eight bytes at a time, over `size` bytes
+// (a multiple of 8): enough to tell one ROM set or RAM image from another,
+// and quick, since Restore8080 runs it every time
+static uint32_t Hash8080(const uint8_t *p, int size) {
+  uint64_t sum = 0, sum_of_sums = 0;
+  for (int i = 0; i < size; i += 8) {
+    uint64_t w;
+    memcpy(&w, &p[i], 8);
+    sum += w;
+    sum_of_sums += sum;
+  }
+  return (sum ^ sum >> 32) * 31 + (sum_of_sums ^ sum_of_sums >> 32);
+}
+
+static uint32_t RomHash(const uint8_t *memory) {
+  return Hash8080(memory, ROM_SIZE);
+}
+
+static uint32_t RamHash(const uint8_t *memory) {
+  return Hash8080(&memory[ROM_SIZE], RAM_SIZE);
+}
+
+static uint8_t* Put(uint8_t *p, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++)
+    *p++ = value >> (8 * i);
+  return p;
+}
+
+static uint64_t Get(const uint8_t **p, int bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; i++)
+    value |= (uint64_t) *(*p)++ << (8 * i);
+  return value;
+}
+
+/**
+ * Saves the machine to `buf`, which has room for `size` bytes. Returns the
+ * number of bytes used, at most SNAPSHOT_SIZE, or 0 if it does not fit or
+ * an event is not one of SnapshotEvents.
+ */
+size_t Snapshot8080(const State8080 *state, uint8_t *buf, size_t size) {
+  const Scheduler *sched = &state->sched;
+  size_t need = SNAPSHOT_SIZE -
+                (MAX_EVENTS - sched->count) * SNAPSHOT_EVENT_SIZE;
+  if (size < need)
+    return 0;
+  uint8_t *p = buf;
+  memcpy(p, "8080", 4);
+  p = Put(p + 4, SNAPSHOT_VERSION, 2);
+  p = Put(p, RomHash(state->memory), 4);
+  const uint8_t regs[7] = { state->a, state->b, state->c, state->d,
+                            state->e, state->h, state->l };
+  memcpy(p, regs, 7);
+  p = Put(p + 7, state->sp, 2);
+  p = Put(p, state->pc, 2);
+  p = Put(p, LazyFlagsPSW(LazyFlagsFromCC(state->cc)), 1);
+  p = Put(p, state->int_enable, 1);
+  p = Put(p, state->halted, 1);
+  p = Put(p, state->fault, 1);
+  p = Put(p, state->cycles, 8);
+  p = Put(p, state->io.shift, 2);
+  p = Put(p, state->io.shift_offset, 1);
+  memcpy(p, state->io.in_port, 3);
+  memcpy(p + 3, state->io.sound, 2);
+  p = Put(p + 5, sched->count, 1);
+  for (int i = 0; i < sched->count; i++) {
+    int id = 0;
+    while (id < SNAPSHOT_EVENTS && SnapshotEvents[id] != sched->events[i].fn)
+      id++;
+    if (id == SNAPSHOT_EVENTS)
+      return 0;
+    p = Put(p, sched->events[i].when, 8);
+    p = Put(p, id, 1);
+    p = Put(p, (uint32_t) sched->events[i].arg, 4);
+  }
+  memcpy(p, &state->memory[ROM_SIZE], RAM_SIZE);
+  return p + RAM_SIZE - buf;
+}
+
+/**
+ * Puts the machine back as `buf` says, e.g. once a frame to replay from a
+ * fixed point. Returns 0, leaving the machine alone, if `buf` is not a
+ * snapshot this version can read or was taken with other ROMs.
+ */
+int Restore8080(State8080 *state, const uint8_t *buf, size_t size) {
+  const uint8_t *p = buf, *end = buf + size;
+  if (size < SNAPSHOT_HEADER_SIZE || memcmp(p, "8080", 4) != 0)
+    return 0;
+  p += 4;
+  if (Get(&p, 2) != SNAPSHOT_VERSION || Get(&p, 4) != RomHash(state->memory))
+    return 0;
+  const uint8_t *regs = p, *rest = p + 7;
+  p = buf + SNAPSHOT_HEADER_SIZE - 1;
+  int count = Get(&p, 1);
+  if (count > MAX_EVENTS ||
+      end - p != count * SNAPSHOT_EVENT_SIZE + RAM_SIZE)
+    return 0;
+  for (int i = 0; i < count; i++)
+    if (p[i * SNAPSHOT_EVENT_SIZE + 8] >= SNAPSHOT_EVENTS)
+      return 0;
+
+  state->a = regs[0];
+  state->b = regs[1];
+  state->c = regs[2];
+  state->d = regs[3];
+  state->e = regs[4];
+  state->h = regs[5];
+  state->l = regs[6];
+  state->sp = Get(&rest, 2);
+  state->pc = Get(&rest, 2);
+  LazyFlagsToCC(LazyFlagsFromPSW(Get(&rest, 1)), &state->cc);
+  state->int_enable = Get(&rest, 1);
+  state->halted = Get(&rest, 1);
+  state->fault = Get(&rest, 1);
+  state->cycles = Get(&rest, 8);
+  state->io.shift = Get(&rest, 2);
+  state->io.shift_offset = Get(&rest, 1);
+  memcpy(state->io.in_port, rest, 3);
+  memcpy(state->io.sound, rest + 3, 2);
+  state->sched.count = count;
+  for (int i = 0; i < count; i++) {
+    state->sched.events[i].when = Get(&p, 8);
+    state->sched.events[i].fn = SnapshotEvents[Get(&p, 1)];
+    state->sched.events[i].arg = (int32_t) Get(&p, 4);
+  }
+  memcpy(&state->memory[ROM_SIZE], p, RAM_SIZE);
+  // All of the RAM may have changed: redraw the whole screen, and drop any
+  // blocks decoded from it
+  memset(&state->dirty[ROM_SIZE >> 5], 1, RAM_SIZE >> 5);
+  for (int page = ROM_SIZE >> 8; state->blocks != NULL &&
+       page < MIRROR_SIZE >> 8; page++)
+    if (state->page_flags[page] & PAGE_CODE)
+      InvalidateCodePage(state, page);
+  return 1;
+}
+
+int SaveStateFile(const State8080 *state, const char *filename) {
+  uint8_t buf[SNAPSHOT_SIZE];
+  size_t size = Snapshot8080(state, buf, sizeof(buf));
+  FILE *f = fopen(filename, "wb");
+  if (f == NULL) {
+    printf("error: Couldn't open %s\n", filename);
+    return -1;
+  }
+  fwrite(buf, size, 1, f);
+  fclose(f);
+  return 0;
+}
+
+int LoadStateFile(State8080 *state, const char *filename) {
+  uint8_t buf[SNAPSHOT_SIZE];
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL) {
+    printf("error: Couldn't open %s\n", filename);
+    return -1;
+  }
+  size_t size = fread(buf, 1, sizeof(buf), f);
+  fclose(f);
+  if (!Restore8080(state, buf, size)) {
+    printf("error: %s is not a snapshot of this version and ROM set\n",
+           filename);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * An input log is a snapshot to start from plus every value IN returned
+ * after it, stamped with the cycle it was read at. Everything else the
+ * machine does follows from those, so replaying the log on the same ROMs
+ * plays the session again exactly, as fast as the host can run it. The RAM
+ * hash at each frame boundary is logged as well, so that a replay can tell
+ * in which frame it first went its own way.
+ *
+ * On disk it is a little-endian byte string:
+ *
+ *   "8LOG"                  magic
+ *   u16 version             INPUT_LOG_VERSION
+ *   u32 size, then a snapshot of that size
+ *   u64 end                 cycle the recording stopped at
+ *   u32 frame count, then a u32 RamHash for each frame boundary crossed
+ *   u32 read count, then for each: varint cycles since the previous read
+ *       (since cycle 0 for the first), u8 port, u8 value
+ *
+ * A varint is 7 bits a byte, low bits first, with bit 7 set on all but the
+ * last byte. Reads are usually a few hundred cycles apart, so most take 4
+ * bytes.
+ */
+#define INPUT_LOG_VERSION 1
+
+typedef struct InputRead {
+  uint64_t  cycle;
+  uint8_t   port;
+  uint8_t   value;
+} InputRead;
+
+typedef struct InputLog {
+  uint8_t    snapshot[SNAPSHOT_SIZE];
+  size_t     snapshot_size;
+  uint64_t   end;
+  InputRead *reads;
+  size_t     count;
+  size_t     capacity;
+  uint32_t  *hashes;
+  uint32_t   frames;
+  uint32_t   frames_capacity;
+  // Set while replaying, when reads and hashes are checked instead of added
+  int        replaying;
+  // Replay: the next read to hand out and the next hash to compare
+  size_t     next;
+  uint32_t   next_frame;
+  // Replay: the first IN that was not the logged one, and the first frame
+  // (counted from the snapshot, from 1) whose hash did not match, 0 if none
+  uint64_t   bad_read;
+  uint32_t   bad_frame;
+  // The frame (cycles / FRAME_CYCLES) the machine was last seen in
+  uint64_t   frame;
+  // IN goes through `ports`, which wraps `inner`, the machine's own table
+  Ports     *ports;
+  const Ports *inner;
+} InputLog;
+
+// IN while recording: reads the real port and logs what it returned
+static uint8_t InputRecordIn(State8080 *state, uint8_t port) {
+  InputLog *log = state->user;
+  uint8_t value = log->inner->in[port](state, port);
+  if (log->count == log->capacity) {
+    log->capacity = log->capacity ? log->capacity * 2 : 4096;
+    log->reads = realloc(log->reads, log->capacity * sizeof(InputRead));
+  }
+  log->reads[log->count++] = (InputRead) { state->cycles, port, value };
+  return value;
+}
+
+// IN while replaying: hands out the logged value. A read that is not the
+// next one logged, at that cycle and port, means the replay has diverged:
+// it is noted, and answered from the real port so the run can carry on.
+static uint8_t InputReplayIn(State8080 *state, uint8_t port) {
+  InputLog *log = state->user;
+  if (log->next < log->count && log->reads[log->next].cycle == state->cycles &&
+      log->reads[log->next].port == port)
+    return log->reads[log->next++].value;
+  if (log->bad_read == 0)
+    log->bad_read = state->cycles;
+  return log->inner->in[port](state, port);
+}
+
+// Points the machine's IN ports at `in`, keeping its OUT ports
+static void InputLogAttach(InputLog *log, State8080 *state, PortInFn in) {
+  log->inner = state->ports;
+  log->ports = PortsNew();
+  *log->ports = *state->ports;
+  for (int port = 0; port < 256; port++)
+    log->ports->in[port] = in;
+  state->ports = log->ports;
+  state->user = log;
+  log->frame = state->cycles / FRAME_CYCLES;
+}
+
+/**
+ * Starts logging the machine's inputs from where it is now. Its IN ports
+ * are wrapped and state->user is taken over by the log until InputLogFree.
+ */
+InputLog* InputLogRecord(State8080 *state) {
+  InputLog *log = calloc(1, sizeof(InputLog));
+  log->snapshot_size = Snapshot8080(state, log->snapshot,
+                                    sizeof(log->snapshot));
+  InputLogAttach(log, state, InputRecordIn);
+  return log;
+}
+
+/**
+ * Call after each RunHalfFrame8080 slice: once the machine has crossed into
+ * a new frame, logs the hash of its RAM, or when replaying, checks it. The
+ * hash is taken where the slice ended, just past the frame boundary, and
+ * any loop slicing with RunHalfFrame8080 ends its slices on the same
+ * cycles, so a recording checks out wherever it is replayed.
+ */
+void InputLogFrame(InputLog *log, const State8080 *state) {
+  uint64_t frame = state->cycles / FRAME_CYCLES;
+  for (; log->frame < frame; log->frame++) {
+    uint32_t hash = RamHash(state->memory);
+    if (log->replaying) {
+      if (log->bad_frame == 0 && (log->next_frame >= log->frames ||
+                                  log->hashes[log->next_frame] != hash))
+        log->bad_frame = log->next_frame + 1;
+      log->next_frame++;
+      continue;
+    }
+    if (log->frames == log->frames_capacity) {
+      log->frames_capacity = log->frames_capacity ? log->frames_capacity * 2
+                                                  : 1024;
+      log->hashes = realloc(log->hashes,
+                            log->frames_capacity * sizeof(uint32_t));
+    }
+    log->hashes[log->frames++] = hash;
+  }
+}
+
+/**
+ * Hands the machine its own ports and state->user back and frees the log.
+ */
+void InputLogFree(InputLog *log, State8080 *state) {
+  if (log == NULL)
+    return;
+  if (state != NULL && state->user == log) {
+    state->ports = log->inner;
+    state->user = NULL;
+  }
+  free(log->ports);
+  free(log->reads);
+  free(log->hashes);
+  free(log);
+}
+
+/**
+ * Writes a recording that stopped with the machine at `state`.
+ */
+int InputLogSave(InputLog *log, const State8080 *state, const char *filename) {
+  if (log->snapshot_size == 0) {
+    printf("error: The machine could not be snapshotted\n");
+    return -1;
+  }
+  log->end = state->cycles;
+  size_t size = 26 + log->snapshot_size + (size_t) log->frames * 4 +
+                log->count * 12;
+  uint8_t *buf = malloc(size), *p = buf;
+  memcpy(p, "8LOG", 4);
+  p = Put(p + 4, INPUT_LOG_VERSION, 2);
+  p = Put(p, log->snapshot_size, 4);
+  memcpy(p, log->snapshot, log->snapshot_size);
+  p = Put(p + log->snapshot_size, log->end, 8);
+  p = Put(p, log->frames, 4);
+  for (uint32_t i = 0; i < log->frames; i++)
+    p = Put(p, log->hashes[i], 4);
+  p = Put(p, log->count, 4);
+  uint64_t last = 0;
+  for (size_t i = 0; i < log->count; i++) {
+    uint64_t delta = log->reads[i].cycle - last;
+    last = log->reads[i].cycle;
+    for (; delta >= 0x80; delta >>= 7)
+      *p++ = delta | 0x80;
+    *p++ = delta;
+    *p++ = log->reads[i].port;
+    *p++ = log->reads[i].value;
+  }
+  FILE *f = fopen(filename, "wb");
+  if (f == NULL) {
+    printf("error: Couldn't open %s\n", filename);
+    free(buf);
+    return -1;
+  }
+  int ok = fwrite(buf, p - buf, 1, f) == 1;
+  ok &= fclose(f) == 0;
+  free(buf);
+  if (!ok) {
+    printf("error: Couldn't write %s\n", filename);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Reads a log written by InputLogSave, or returns NULL if it cannot.
+ */
+InputLog* InputLogLoad(const char *filename) {
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL) {
+    printf("error: Couldn't open %s\n", filename);
+    return NULL;
+  }
+  size_t size = 0, capacity = 1 << 16, got;
+  uint8_t *buf = malloc(capacity);
+  while ((got = fread(buf + size, 1, capacity - size, f)) > 0) {
+    size += got;
+    if (size == capacity)
+      buf = realloc(buf, capacity *= 2);
+  }
+  fclose(f);
+
+  InputLog *log = calloc(1, sizeof(InputLog));
+  const uint8_t *p = buf, *end = buf + size;
+  int ok = size >= 10 && memcmp(p, "8LOG", 4) == 0;
+  if (ok) {
+    p += 4;
+    ok = Get(&p, 2) == INPUT_LOG_VERSION;
+    log->snapshot_size = Get(&p, 4);
+    ok = ok && log->snapshot_size <= SNAPSHOT_SIZE &&
+         (size_t) (end - p) >= log->snapshot_size + 12;
+  }
+  if (ok) {
+    memcpy(log->snapshot, p, log->snapshot_size);
+    p += log->snapshot_size;
+    log->end = Get(&p, 8);
+    log->frames = Get(&p, 4);
+    ok = (size_t) (end - p) >= (size_t) log->frames * 4 + 4;
+  }
+  if (ok) {
+    log->hashes = malloc(((size_t) log->frames + 1) * sizeof(uint32_t));
+    for (uint32_t i = 0; i < log->frames; i++)
+      log->hashes[i] = Get(&p, 4);
+    log->count = log->capacity = Get(&p, 4);
+    // Each read takes at least 3 bytes
+    ok = (size_t) (end - p) >= log->count * 3;
+  }
+  if (ok) {
+    log->reads = malloc((log->count + 1) * sizeof(InputRead));
+    uint64_t last = 0;
+    for (size_t i = 0; ok && i < log->count; i++) {
+      uint64_t delta = 0;
+      int shift = 0;
+      while (p < end && *p & 0x80 && shift < 63) {
+        delta |= (uint64_t) (*p++ & 0x7f) << shift;
+        shift += 7;
+      }
+      ok = end - p >= 3;
+      if (!ok)
+        break;
+      delta |= (uint64_t) *p++ << shift;
+      last += delta;
+      log->reads[i] = (InputRead) { last, p[0], p[1] };
+      p += 2;
+    }
+  }
+  free(buf);
+  if (!ok) {
+    printf("error: %s is not an input log of this version\n", filename);
+    InputLogFree(log, NULL);
+    return NULL;
+  }
+  return log;
+}
+
+/**
+ * Plays a log back on a machine with the same ROMs, in half-frame slices on
+ * `run` with nothing else going on. Returns 1 if every read and every frame
+ * boundary matched, 0 if not (see bad_read and bad_frame), and -1 if the
+ * snapshot does not fit the machine.
+ */
+int InputLogReplay(InputLog *log, State8080 *state, Backend8080 run) {
+  if (!Restore8080(state, log->snapshot, log->snapshot_size))
+    return -1;
+  log->replaying = 1;
+  log->next = 0;
+  log->next_frame = 0;
+  log->bad_read = 0;
+  log->bad_frame = 0;
+  InputLogAttach(log, state, InputReplayIn);
+  while (state->cycles < log->end && !(state->halted && !state->int_enable)) {
+    RunHalfFrame8080(state, run);
+    InputLogFrame(log, state);
+  }
+  if (log->bad_read == 0 && log->next < log->count)
+    log->bad_read = log->reads[log->next].cycle;
+  if (log->bad_frame == 0 && log->next_frame != log->frames)
+    log->bad_frame = log->next_frame + 1;
+  return log->bad_read == 0 && log->bad_frame == 0 &&
+         state->cycles == log->end;
+}
+
+// Lanes per group in the batch core: one AVX2 register of 32-bit values
+#define BATCH_GROUP 8
+
+// Fields of a lane while the batch core runs it. The first eight follow the
+// 8080's own register numbering in opcodes (B C D E H L M A), with SP in the
+// M slot, which no opcode names as a register.
+enum {
+  LANE_B, LANE_C, LANE_D, LANE_E, LANE_H, LANE_L, LANE_SP, LANE_A,
+  LANE_PC, LANE_ZSP, LANE_AUX, LANE_CY, LANE_LEFT, LANE_FIELDS
+};
+
+/**
+ * Many machines stepped together by one thread. Between calls each lane is
+ * an ordinary State8080; while BatchRun8080 runs, the registers are held as
+ * a struct of arrays so that a group of lanes at the same pc runs one opcode
+ * for all of them with AVX2. Lanes that are somewhere else, or at an
+ * instruction the vector code does not cover, are stepped by Run8080.
+ */
+typedef struct Batch8080 {
+  int         count;
+  int         padded;  // count rounded up to whole groups
+  State8080 **lanes;
+  // Every lane's 64K in one block, lane i's at i << 16, so that one base
+  // pointer and a vector of 32-bit offsets reach a byte in each lane
+  uint8_t    *arena;
+  // Where the arena came from: windows in this pool, which is the batch's
+  // own unless `shared_pool` is set, or else malloc
+  MemoryPool *pool;
+  int         shared_pool;
+  // Lane i's field f is reg[f * padded + i]
+  uint32_t   *reg;
+  // Cycle count each lane's slice ends at, 0 if it sits this slice out
+  uint64_t   *stop;
+  uint64_t   *until;
+  uint64_t    group_steps;  // instructions run by the vector code
+  uint64_t    lane_steps;   // lanes those stepped, in all
+  uint64_t    scalar_steps; // instructions run by Run8080 on one lane
+} Batch8080;
+
+// Code below this address is the same in every lane unless a lane has
+// written to it, so one lane's fetch does for all of them
+#define BATCH_SHARED_END 0x2000
+
+#define LANE(batch, field, i) ((batch)->reg[(field) * (batch)->padded + (i)])
+
+// Makes the lanes, with the next `count` windows of `pool` as their memory,
+// or with memory of their own if `pool` is NULL. The pool must be new, so
+// that the windows come one after the other.
+static Batch8080* BatchNewInPool(const State8080 *model, int count,
+                                 MemoryPool *pool) {
+  Batch8080 *batch = calloc(1, sizeof(Batch8080));
+  int padded = (count + BATCH_GROUP - 1) / BATCH_GROUP * BATCH_GROUP;
+  batch->count = count;
+  batch->padded = padded;
+  batch->lanes = malloc(count * sizeof(State8080 *));
+  // A fetch reads 4 bytes, possibly past the last lane's memory: the pool
+  // has a spare page at the end for that
+  batch->pool = pool;
+  batch->arena = pool != NULL ? MemoryPoolTake(pool)
+                              : malloc(((size_t) padded << 16) + 4);
+  for (int i = 1; pool != NULL && i < count; i++)
+    MemoryPoolTake(pool);
+  batch->reg = calloc((size_t) LANE_FIELDS * padded, sizeof(uint32_t));
+  batch->stop = calloc(padded, sizeof(uint64_t));
+  batch->until = calloc(padded, sizeof(uint64_t));
+  for (int i = 0; i < count; i++) {
+    State8080 *lane = CloneWithMemory8080(model,
+                                          &batch->arena[(size_t) i << 16],
+                                          pool != NULL);
+    if (pool == NULL)
+      memcpy(lane->memory, model->memory, 0x10000);
+    // Every lane starts with the same ROM. From here on a dirty mark below
+    // BATCH_SHARED_END says a lane's copy may have changed.
+    memset(lane->dirty, 0, BATCH_SHARED_END >> 5);
+    batch->lanes[i] = lane;
+  }
+  return batch;
+}
+
+/**
+ * Makes `count` lanes, each a copy of `model`. Change a lane's memory only
+ * through WriteByte after this, so that its dirty marks show it.
+ */
+Batch8080* BatchNew(const State8080 *model, int count) {
+  return BatchNewInPool(model, count, MemoryPoolNew(model->memory, count));
+}
+
+void BatchFree(Batch8080 *batch) {
+  for (int i = 0; i < batch->count; i++) {
+    // The memory is part of the arena
+    free(batch->lanes[i]->blocks);
+    TraceRingFree(batch->lanes[i]->trace);
+    free(batch->lanes[i]);
+  }
+  free(batch->lanes);
+  if (batch->pool == NULL)
+    free(batch->arena);
+  else if (!batch->shared_pool)
+    MemoryPoolFree(batch->pool);
+  free(batch->reg);
+  free(batch->stop);
+  free(batch->until);
+  free(batch);
+}
+
+// Copies lane i from its State8080 into the arrays
+static void BatchLoadLane(Batch8080 *batch, int i) {
+  State8080 *s = batch->lanes[i];
+  LazyFlags f = LazyFlagsFromCC(s->cc);
+  LANE(batch, LANE_B, i) = s->b;
+  LANE(batch, LANE_C, i) = s->c;
+  LANE(batch, LANE_D, i) = s->d;
+  LANE(batch, LANE_E, i) = s->e;
+  LANE(batch, LANE_H, i) = s->h;
+  LANE(batch, LANE_L, i) = s->l;
+  LANE(batch, LANE_SP, i) = s->sp;
+  LANE(batch, LANE_A, i) = s->a;
+  LANE(batch, LANE_PC, i) = s->pc;
+  LANE(batch, LANE_ZSP, i) = f.zsp;
+  LANE(batch, LANE_AUX, i) = f.aux;
+  LANE(batch, LANE_CY, i) = f.cy;
+  LANE(batch, LANE_LEFT, i) = (int32_t) (batch->stop[i] - s->cycles);
+}
+
+// And back again
+static void BatchStoreLane(Batch8080 *batch, int i) {
+  State8080 *s = batch->lanes[i];
+  LazyFlags f = { LANE(batch, LANE_ZSP, i), LANE(batch, LANE_AUX, i),
+                  LANE(batch, LANE_CY, i) };
+  s->b = LANE(batch, LANE_B, i);
+  s->c = LANE(batch, LANE_C, i);
+  s->d = LANE(batch, LANE_D, i);
+  s->e = LANE(batch, LANE_E, i);
+  s->h = LANE(batch, LANE_H, i);
+  s->l = LANE(batch, LANE_L, i);
+  s->sp = LANE(batch, LANE_SP, i);
+  s->a = LANE(batch, LANE_A, i);
+  s->pc = LANE(batch, LANE_PC, i);
+  LazyFlagsToCC(f, &s->cc);
+  s->cycles = batch->stop[i] - (int32_t) LANE(batch, LANE_LEFT, i);
+}
+
+// Runs one instruction of lane i on Run8080: IN, OUT, EI and the like, or
+// a lane that has gone its own way
+static void BatchStepLane(Batch8080 *batch, int i) {
+  State8080 *s = batch->lanes[i];
+  BatchStoreLane(batch, i);
+  Run8080(s, 1);
+  // Halting uses up the rest of the slice, as it does in Run8080
+  if (s->halted && s->cycles < batch->stop[i])
+    s->cycles = batch->stop[i];
+  BatchLoadLane(batch, i);
+  batch->scalar_steps++;
+}
+
+// Whether no lane of the group has written below BATCH_SHARED_END
+static int BatchCodeShared(const Batch8080 *batch, int first) {
+  for (int i = first; i < first + BATCH_GROUP && i < batch->count; i++)
+    if (memchr(batch->lanes[i]->dirty, 1, BATCH_SHARED_END >> 5) != NULL)
+      return 0;
+  return 1;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_AVX2_BATCH 1
+
+// Eight lanes of one field, and a per-lane mask of all ones or all zeros
+typedef uint32_t LaneVec __attribute__((vector_size(32)));
+typedef int32_t LaneMask __attribute__((vector_size(32)));
+
+/**
+ * Runs group `g` of lanes until each has used up its slice. Every step
+ * picks the lowest lane still running, takes every lane at the same pc with
+ * the same instruction bytes, and runs that instruction for all of them:
+ * loads are AVX2 gathers from the arena, and results are merged in under
+ * the mask so the other lanes keep their values. AVX2 has no scatter, so
+ * stores go out one lane at a time through StoreByte. Gathers are slow, so
+ * code in the shared ROM is fetched from the leading lane alone.
+ */
+__attribute__((target("avx2")))
+static void BatchRunGroupAVX2(Batch8080 *batch, int g) {
+  const int first = g * BATCH_GROUP;
+  const int *arena = (const int *) batch->arena;
+  LaneVec r[LANE_FIELDS];
+  LaneMask base = { 0, 1, 2, 3, 4, 5, 6, 7 };
+  base = (base + first) << 16;
+
+#define LOAD_GROUP() \
+  for (int f = 0; f < LANE_FIELDS; f++) \
+    memcpy(&r[f], &LANE(batch, f, first), sizeof(LaneVec))
+#define STORE_GROUP() \
+  for (int f = 0; f < LANE_FIELDS; f++) \
+    memcpy(&LANE(batch, f, first), &r[f], sizeof(LaneVec))
+// A 4-byte load from each lane in the mask, 0 for the others
+#define GATHER(mask, adr) \
+  ((LaneVec) _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), arena, \
+     (__m256i) (base + (LaneMask) ((adr) & 0xffff)), (__m256i) (mask), 1))
+#define RD(adr)       (GATHER(m, adr) & 0xff)
+#define WR(adr, x) \
+  do { LaneVec _a = (adr), _x = (x); \
+       for (int _b = bits; _b; _b &= _b - 1) { \
+         int _k = __builtin_ctz(_b); \
+         if (_a[_k] < BATCH_SHARED_END) shared = 0; \
+         StoreByte(batch->lanes[first + _k], _a[_k], _x[_k]); } } while (0)
+// Only the lanes in the mask take the new value
+#define SET(f, x) \
+  (r[f] = (LaneVec) ((m & (LaneMask) (x)) | (~m & (LaneMask) r[f])))
+#define PAIR(rp) \
+  ((rp) == 3 ? r[LANE_SP] : r[2 * (rp)] << 8 | r[2 * (rp) + 1])
+#define SETPAIR(rp, x) \
+  do { LaneVec _v = (x) & 0xffff; \
+       if ((rp) == 3) { SET(LANE_SP, _v); } \
+       else { SET(2 * (rp), _v >> 8); SET(2 * (rp) + 1, _v & 0xff); } \
+  } while (0)
+#define A   r[LANE_A]
+#define HL  PAIR(2)
+#define SP  r[LANE_SP]
+#define CY  r[LANE_CY]
+// The same lazy flags as Run8080's ADD8, SUB8 and so on
+#define ADD8(x, carry) \
+  do { LaneVec _v = (x), _r = A + _v + (carry); \
+       SET(LANE_AUX, (A ^ _v ^ _r) & 0xff); SET(LANE_CY, _r >> 8); \
+       SET(LANE_A, _r & 0xff); SET(LANE_ZSP, _r & 0xff); } while (0)
+#define SUB8(x, borrow, keep) \
+  do { LaneVec _v = (x), _r = (A - _v - (borrow)) & 0xffff; \
+       SET(LANE_AUX, ~(A ^ _v ^ _r) & 0xff); SET(LANE_CY, (_r >> 8) & 1); \
+       if (!(keep)) { SET(LANE_A, _r & 0xff); } \
+       SET(LANE_ZSP, _r & 0xff); } while (0)
+#define LOGIC(res, ac) \
+  do { LaneVec _r = (res); SET(LANE_AUX, (ac) & 0xff); SET(LANE_CY, zero); \
+       SET(LANE_A, _r); SET(LANE_ZSP, _r); } while (0)
+#define INCDEC(x, delta, flip) \
+  ({ LaneVec _o = (x), _n = (_o + (delta)) & 0xff; \
+     SET(LANE_AUX, ((_o ^ 1 ^ _n) ^ (flip)) & 0xff); SET(LANE_ZSP, _n); _n; })
+#define PUSH(hi, lo) \
+  do { WR(SP - 1, hi); WR(SP - 2, lo); SET(LANE_SP, (SP - 2) & 0xffff); \
+  } while (0)
+// S, Z and P as ZSPTable has them, worked out in place: the second half of
+// the table just masks a popped PSW
+#define ZSP_FLAGS() \
+  ({ LaneVec _z = r[LANE_ZSP], _x = _z & 0xff, _p = _x ^ _x >> 4; \
+     LaneMask _popped = (LaneMask) (_z & 0x100) != 0; \
+     _p ^= _p >> 2; _p ^= _p >> 1; \
+     (LaneVec) ((_popped & (LaneMask) (_z & 0xc4)) | \
+                (~_popped & (LaneMask) ((_x & FLAG_S) | (~_p & 1) << 2 | \
+                  ((LaneVec) ((LaneMask) _x == 0) & FLAG_Z)))); })
+// Lanes for which the condition in bits 3-5 of a Jcc, Ccc or Rcc holds:
+// NZ Z NC C PO PE P M
+#define TAKEN() \
+  ({ static const uint8_t _bit[4] = { FLAG_Z, FLAG_CY, FLAG_P, FLAG_S }; \
+     LaneVec _f = ((op >> 4) & 3) == 1 ? CY \
+                                       : ZSP_FLAGS() & _bit[(op >> 4) & 3]; \
+     (op & 0x08) ? (LaneMask) _f != 0 : (LaneMask) _f == 0; })
+
+  LOAD_GROUP();
+  const LaneVec zero = { 0 };
+  int shared = BatchCodeShared(batch, first);
+  for (;;) {
+    LaneMask m = (LaneMask) r[LANE_LEFT] > 0;
+    int bits = _mm256_movemask_ps((__m256) m);
+    if (bits == 0)
+      break;
+    int lead = __builtin_ctz(bits);
+    uint32_t pc = r[LANE_PC][lead];
+    m &= r[LANE_PC] == pc;
+    uint32_t word;
+    uint8_t op;
+    int len;
+    if (shared && pc + 3 <= BATCH_SHARED_END) {
+      // Every lane at this pc has the same bytes there
+      memcpy(&word, &batch->arena[((size_t) (first + lead) << 16) + pc], 4);
+      op = word;
+      len = Length8080[op];
+    } else {
+      LaneVec code = GATHER(m, r[LANE_PC]);
+      word = code[lead];
+      op = word;
+      len = Length8080[op];
+      m &= ((code ^ word) & (0xffffffu >> (8 * (3 - len)))) == 0;
+    }
+    bits = _mm256_movemask_ps((__m256) m);
+
+    if (op == 0x27 || op == 0x76 || (op & 0xc7) == 0xc7 ||
+        pc + len > 0x10000) {
+      // DAA, HLT, RST, or an operand that wraps around to address 0: let
+      // Run8080 do it, lane by lane
+      STORE_GROUP();
+      for (int b = bits; b; b &= b - 1)
+        BatchStepLane(batch, first + __builtin_ctz(b));
+      LOAD_GROUP();
+      shared = shared && BatchCodeShared(batch, first);
+      continue;
+    }
+    batch->group_steps++;
+    batch->lane_steps += __builtin_popcount(bits);
+
+    uint8_t imm8 = word >> 8;
+    uint16_t imm16 = word >> 8;
+    LaneVec next = zero + ((pc + len) & 0xffff);
+    SET(LANE_LEFT, r[LANE_LEFT] - Cycles8080[op]);
+    SET(LANE_PC, next);
+
+    if (op >= 0x40 && op < 0x80) {
+      int dst = (op >> 3) & 7, src = op & 7;         // MOV
+      LaneVec v = src == 6 ? RD(HL) : r[src];
+      if (dst == 6)
+        WR(HL, v);
+      else
+        SET(dst, v);
+      continue;
+    }
+    if ((op >= 0x80 && op < 0xc0) || (op & 0xc7) == 0xc6) {
+      LaneVec v = op >= 0xc0 ? zero + imm8 : (op & 7) == 6 ? RD(HL) : r[op & 7];
+      switch ((op >> 3) & 7) {
+      case 0: ADD8(v, 0); break;
+      case 1: ADD8(v, CY); break;
+      case 2: SUB8(v, 0, 0); break;
+      case 3: SUB8(v, CY, 0); break;
+      case 4: LOGIC(A & v, (A | v) << 1); break;
+      case 5: LOGIC(A ^ v, zero); break;
+      case 6: LOGIC(A | v, zero); break;
+      case 7: SUB8(v, 0, 1); break;
+      }
+      continue;
+    }
+    int rp = (op >> 4) & 3, reg = (op >> 3) & 7;
+    switch (op) {
+    case 0x01: case 0x11: case 0x21: case 0x31:      // LXI
+      SETPAIR(rp, zero + imm16);
+      break;
+    case 0x02: case 0x12:                            // STAX
+      WR(PAIR(rp), A);
+      break;
+    case 0x0a: case 0x1a:                            // LDAX
+      SET(LANE_A, RD(PAIR(rp)));
+      break;
+    case 0x03: case 0x13: case 0x23: case 0x33:      // INX
+      SETPAIR(rp, PAIR(rp) + 1);
+      break;
+    case 0x0b: case 0x1b: case 0x2b: case 0x3b:      // DCX
+      SETPAIR(rp, PAIR(rp) - 1);
+      break;
+    case 0x09: case 0x19: case 0x29: case 0x39: {    // DAD
+      LaneVec sum = HL + PAIR(rp);
+      SET(LANE_CY, sum >> 16);
+      SETPAIR(2, sum);
+      break;
+    }
+    case 0x04: case 0x0c: case 0x14: case 0x1c:      // INR
+    case 0x24: case 0x2c: case 0x34: case 0x3c:
+    case 0x05: case 0x0d: case 0x15: case 0x1d:      // DCR
+    case 0x25: case 0x2d: case 0x35: case 0x3d: {
+      int dec = op & 1;
+      LaneVec adr = HL, x = reg == 6 ? RD(adr) : r[reg];
+      x = INCDEC(x, dec ? 0xff : 1, dec ? 0xff : 0);
+      if (reg == 6)
+        WR(adr, x);
+      else
+        SET(reg, x);
+      break;
+    }
+    case 0x06: case 0x0e: case 0x16: case 0x1e:      // MVI
+    case 0x26: case 0x2e: case 0x36: case 0x3e:
+      if (reg == 6)
+        WR(HL, zero + imm8);
+      else
+        SET(reg, zero + imm8);
+      break;
+    case 0x07:                                       // RLC
+      SET(LANE_CY, A >> 7);
+      SET(LANE_A, (A << 1 | A >> 7) & 0xff);
+      break;
+    case 0x0f:                                       // RRC
+      SET(LANE_CY, A & 1);
+      SET(LANE_A, A >> 1 | (A & 1) << 7);
+      break;
+    case 0x17: {                                     // RAL
+      LaneVec out = A >> 7;
+      SET(LANE_A, (A << 1 | CY) & 0xff);
+      SET(LANE_CY, out);
+      break;
+    }
+    case 0x1f: {                                     // RAR
+      LaneVec out = A & 1;
+      SET(LANE_A, A >> 1 | CY << 7);
+      SET(LANE_CY, out);
+      break;
+    }
+    case 0x22:                                       // SHLD
+      WR(zero + imm16, r[LANE_L]);
+      WR(zero + (uint16_t) (imm16 + 1), r[LANE_H]);
+      break;
+    case 0x2a: {                                     // LHLD
+      LaneVec lo = RD(zero + imm16), hi = RD(zero + (uint16_t) (imm16 + 1));
+      SET(LANE_L, lo);
+      SET(LANE_H, hi);
+      break;
+    }
+    case 0x2f:                                       // CMA
+      SET(LANE_A, ~A & 0xff);
+      break;
+    case 0x32:                                       // STA
+      WR(zero + imm16, A);
+      break;
+    case 0x3a:                                       // LDA
+      SET(LANE_A, RD(zero + imm16));
+      break;
+    case 0x37:                                       // STC
+      SET(LANE_CY, zero + 1);
+      break;
+    case 0x3f:                                       // CMC
+      SET(LANE_CY, CY ^ 1);
+      break;
+    case 0xc3: case 0xcb:                            // JMP
+      SET(LANE_PC, zero + imm16);
+      break;
+    case 0xc2: case 0xca: case 0xd2: case 0xda:      // Jcc
+    case 0xe2: case 0xea: case 0xf2: case 0xfa:
+      m &= TAKEN();
+      SET(LANE_PC, zero + imm16);
+      break;
+    case 0xc4: case 0xcc: case 0xd4: case 0xdc:      // Ccc
+    case 0xe4: case 0xec: case 0xf4: case 0xfc:
+      m &= TAKEN();
+      bits = _mm256_movemask_ps((__m256) m);
+      SET(LANE_LEFT, r[LANE_LEFT] - 6);
+      /* fall through */
+    case 0xcd: case 0xdd: case 0xed: case 0xfd:      // CALL
+      PUSH(next >> 8, next & 0xff);
+      SET(LANE_PC, zero + imm16);
+      break;
+    case 0xc0: case 0xc8: case 0xd0: case 0xd8:      // Rcc
+    case 0xe0: case 0xe8: case 0xf0: case 0xf8:
+      m &= TAKEN();
+      SET(LANE_LEFT, r[LANE_LEFT] - 6);
+      /* fall through */
+    case 0xc9: case 0xd9: {                          // RET
+      LaneVec lo = RD(SP), hi = RD(SP + 1);
+      SET(LANE_PC, hi << 8 | lo);
+      SET(LANE_SP, (SP + 2) & 0xffff);
+      break;
+    }
+    case 0xc1: case 0xd1: case 0xe1: {               // POP
+      LaneVec lo = RD(SP), hi = RD(SP + 1);
+      SET(2 * rp, hi);
+      SET(2 * rp + 1, lo);
+      SET(LANE_SP, (SP + 2) & 0xffff);
+      break;
+    }
+    case 0xf1: {                                     // POP PSW
+      LaneVec psw = RD(SP), hi = RD(SP + 1);
+      SET(LANE_ZSP, 0x100 | psw);
+      SET(LANE_AUX, psw);
+      SET(LANE_CY, psw & FLAG_CY);
+      SET(LANE_A, hi);
+      SET(LANE_SP, (SP + 2) & 0xffff);
+      break;
+    }
+    case 0xc5: case 0xd5: case 0xe5:                 // PUSH
+      PUSH(r[2 * rp], r[2 * rp + 1]);
+      break;
+    case 0xf5:                                       // PUSH PSW
+      PUSH(A, ZSP_FLAGS() | (r[LANE_AUX] & FLAG_AC) | 0x02 | CY);
+      break;
+    case 0xe3: {                                     // XTHL
+      LaneVec lo = RD(SP), hi = RD(SP + 1);
+      WR(SP, r[LANE_L]);
+      WR(SP + 1, r[LANE_H]);
+      SET(LANE_L, lo);
+      SET(LANE_H, hi);
+      break;
+    }
+    case 0xe9:                                       // PCHL
+      SET(LANE_PC, HL);
+      break;
+    case 0xf9:                                       // SPHL
+      SET(LANE_SP, HL);
+      break;
+    case 0xd3:                                       // OUT
+    case 0xdb: {                                     // IN
+      // Port handlers get their own lane's State8080, with the time set
+      // as Run8080 would
+      LaneVec in = zero;
+      for (int b = bits; b; b &= b - 1) {
+        int k = __builtin_ctz(b);
+        State8080 *s = batch->lanes[first + k];
+        s->cycles = batch->stop[first + k] - (int32_t) r[LANE_LEFT][k];
+        if (op == 0xdb)
+          in[k] = s->ports->in[imm8](s, imm8);
+        else
+          s->ports->out[imm8](s, imm8, A[k]);
+      }
+      if (op == 0xdb)
+        SET(LANE_A, in);
+      break;
+    }
+    case 0xf3: case 0xfb:                            // DI, EI
+      for (int b = bits; b; b &= b - 1)
+        batch->lanes[first + __builtin_ctz(b)]->int_enable = op == 0xfb;
+      break;
+    case 0xeb: {                                     // XCHG
+      LaneVec d = r[LANE_D], e = r[LANE_E];
+      SET(LANE_D, r[LANE_H]);
+      SET(LANE_E, r[LANE_L]);
+      SET(LANE_H, d);
+      SET(LANE_L, e);
+      break;
+    }
+    default:                                         // NOP
+      break;
+    }
+  }
+  STORE_GROUP();
+#undef LOAD_GROUP
+#undef STORE_GROUP
+#undef GATHER
+#undef RD
+#undef WR
+#undef SET
+#undef PAIR
+#undef SETPAIR
+#undef A
+#undef HL
+#undef SP
+#undef CY
+#undef ADD8
+#undef SUB8
+#undef LOGIC
+#undef INCDEC
+#undef PUSH
+#undef ZSP_FLAGS
+#undef TAKEN
+}
+#endif
+
+// Runs every lane with a slice until it has used it up
+static void BatchRunLanes(Batch8080 *batch) {
+#if defined(HAVE_AVX2_BATCH)
+  if (__builtin_cpu_supports("avx2")) {
+    for (int g = 0; g < batch->padded / BATCH_GROUP; g++)
+      BatchRunGroupAVX2(batch, g);
+    return;
+  }
+#endif
+  for (int i = 0; i < batch->count; i++) {
+    if (batch->stop[i] == 0)
+      continue;
+    BatchStoreLane(batch, i);
+    Run8080(batch->lanes[i], batch->stop[i] - batch->lanes[i]->cycles);
+    BatchLoadLane(batch, i);
+    batch->scalar_steps++;
+  }
+}
+
+/**
+ * Runs every lane to the end of its current half frame, with its events,
+ * exactly as RunHalfFrame8080 would run it alone.
+ */
+void BatchRun8080(Batch8080 *batch) {
+  for (int i = 0; i < batch->count; i++)
+    batch->until[i] = HalfFrameEnd(batch->lanes[i]->cycles);
+  for (;;) {
+    int pending = 0, running = 0;
+    for (int i = 0; i < batch->padded; i++) {
+      State8080 *s = i < batch->count ? batch->lanes[i] : NULL;
+      batch->stop[i] = 0;
+      LANE(batch, LANE_LEFT, i) = 0;
+      if (s == NULL || s->cycles >= batch->until[i])
+        continue;
+      pending = 1;
+      uint64_t stop = SliceEnd(s, batch->until[i]);
+      if (stop <= s->cycles)
+        continue;
+      if (s->halted) {
+        s->cycles = stop;
+        continue;
+      }
+      batch->stop[i] = stop;
+      BatchLoadLane(batch, i);
+      running = 1;
+    }
+    if (!pending)
+      break;
+    if (running) {
+      BatchRunLanes(batch);
+      for (int i = 0; i < batch->count; i++)
+        if (batch->stop[i] != 0)
+          BatchStoreLane(batch, i);
+    }
+    for (int i = 0; i < batch->count; i++)
+      FireDueEvents(batch->lanes[i]);
+  }
+}
+
+// Called before each frame of each machine, on whichever thread runs it,
+// e.g. to feed it inputs
+typedef void (*FleetFrameFn)(State8080 *state, int index, uint64_t frame,
+                             void *user);
+
+// One worker's share of the machines still to run this frame: the next
+// index in the low 32 bits and the end in the high 32 bits, so that the
+// owner taking from the front and thieves taking from the back both change
+// it with one compare-and-swap. Padded to a cache line so that workers do not
+// slow each other down.
+typedef struct FleetQueue {
+  _Alignas(64) _Atomic uint64_t range;
+} FleetQueue;
+
+// Many independent machines run a frame at a time on a pool of threads
+typedef struct Fleet {
+  State8080   **machines;
+  int           count;
+  Backend8080   run;
+  // With FleetNewBatched, machines BATCH_GROUP * t on are lanes of
+  // batches[t], and the workers share out batches rather than machines
+  Batch8080   **batches;
+  int           tasks;
+  // The machines' memory, or NULL if each has its own 64K
+  MemoryPool   *pool;
+  FleetFrameFn  before_frame; // may be NULL
+  void         *user;
+  // Frames run so far, by every machine, and the cycle FleetRun runs them to
+  uint64_t      frame;
+  uint64_t      end;
+  // Worker 0 is the thread calling FleetRun, the rest are in `workers`
+  int           threads;
+  FleetQueue   *queues;
+  pthread_t    *workers;
+  pthread_barrier_t start;
+  pthread_barrier_t done;
+  int           quit;
+} Fleet;
+
+// Takes the next task from the front of the worker's own queue, or -1
+static int FleetTake(FleetQueue *q) {
+  uint64_t r = atomic_load(&q->range);
+  while ((uint32_t) r < (uint32_t) (r >> 32)) {
+    if (atomic_compare_exchange_weak(&q->range, &r, r + 1))
+      return (uint32_t) r;
+  }
+  return -1;
+}
+
+// Moves the back half of some other worker's queue into `self`'s, which is
+// empty. Returns 0 once every queue is empty.
+static int FleetSteal(Fleet *fleet, int self) {
+  for (int k = 1; k < fleet->threads; k++) {
+    FleetQueue *victim = &fleet->queues[(self + k) % fleet->threads];
+    uint64_t r = atomic_load(&victim->range);
+    for (;;) {
+      uint32_t next = r, end = r >> 32;
+      if (next >= end)
+        break;
+      uint32_t from = end - (end - next + 1) / 2;
+      if (atomic_compare_exchange_weak(&victim->range, &r,
+                                       next | (uint64_t) from << 32)) {
+        atomic_store(&fleet->queues[self].range, from | (uint64_t) end << 32);
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+static void FleetRunFrame(Fleet *fleet, int i) {
+  if (fleet->batches != NULL) {
+    Batch8080 *batch = fleet->batches[i];
+    if (fleet->before_frame != NULL)
+      for (int k = 0; k < batch->count; k++)
+        fleet->before_frame(batch->lanes[k], i * BATCH_GROUP + k, fleet->frame,
+                            fleet->user);
+    int done = 1;
+    for (int k = 0; k < batch->count; k++)
+      done &= batch->lanes[k]->cycles >= fleet->end;
+    if (done)
+      return;
+    // A halted lane just uses up its slices
+    for (int half = 0; half < 2; half++)
+      BatchRun8080(batch);
+    return;
+  }
+  State8080 *state = fleet->machines[i];
+  // Stopped for good, e.g. by a fault, or done
+  if ((state->halted && !state->int_enable) || state->cycles >= fleet->end)
+    return;
+  if (fleet->before_frame != NULL)
+    fleet->before_frame(state, i, fleet->frame, fleet->user);
+  for (int half = 0; half < 2; half++)
+    RunHalfFrame8080(state, fleet->run);
+}
+
+// Runs tasks from worker `self`'s queue, then steals, until none are left
+static void FleetWork(Fleet *fleet, int self) {
+  for (;;) {
+    int i = FleetTake(&fleet->queues[self]);
+    if (i >= 0)
+      FleetRunFrame(fleet, i);
+    else if (!FleetSteal(fleet, self))
+      return;
+  }
+}
+
+static void *FleetWorker(void *arg) {
+  Fleet *fleet = ((void **) arg)[0];
+  int self = (int) (intptr_t) ((void **) arg)[1];
+  free(arg);
+  for (;;) {
+    pthread_barrier_wait(&fleet->start);
+    if (fleet->quit)
+      return NULL;
+    FleetWork(fleet, self);
+    pthread_barrier_wait(&fleet->done);
+  }
+}
+
+// Starts the worker threads, which wait for FleetRun
+static void FleetStart(Fleet *fleet, int threads) {
+  if (threads < 1)
+    threads = 1;
+  fleet->threads = threads;
+  fleet->queues = aligned_alloc(sizeof(FleetQueue),
+                                threads * sizeof(FleetQueue));
+  memset(fleet->queues, 0, threads * sizeof(FleetQueue));
+  fleet->workers = malloc(threads * sizeof(pthread_t));
+  pthread_barrier_init(&fleet->start, NULL, threads);
+  pthread_barrier_init(&fleet->done, NULL, threads);
+  for (int w = 1; w < threads; w++) {
+    void **arg = malloc(2 * sizeof(void *));
+    arg[0] = fleet;
+    arg[1] = (void *) (intptr_t) w;
+    pthread_create(&fleet->workers[w], NULL, FleetWorker, arg);
+  }
+}
+
+/**
+ * Makes `count` copies of `model` and starts `threads` - 1 worker threads
+ * for them (the caller of FleetRun is the last one). The model itself is
+ * left alone.
+ */
+Fleet* FleetNew(const State8080 *model, int count, int threads,
+                Backend8080 run) {
+  Fleet *fleet = calloc(1, sizeof(Fleet));
+  fleet->machines = malloc(count * sizeof(State8080 *));
+  fleet->count = count;
+  fleet->tasks = count;
+  fleet->run = run;
+  fleet->pool = MemoryPoolNew(model->memory, count);
+  for (int i = 0; i < count; i++) {
+    if (fleet->pool == NULL) {
+      fleet->machines[i] = Clone8080(model);
+    } else {
+      fleet->machines[i] = CloneWithMemory8080(model,
+                                               MemoryPoolTake(fleet->pool), 1);
+      fleet->machines[i]->pool = fleet->pool;
+    }
+  }
+  FleetStart(fleet, threads);
+  return fleet;
+}
+
+/**
+ * The same, but the machines run in batches of BATCH_GROUP on BatchRun8080,
+ * one batch per task.
+ */
+Fleet* FleetNewBatched(const State8080 *model, int count, int threads) {
+  Fleet *fleet = calloc(1, sizeof(Fleet));
+  fleet->machines = malloc(count * sizeof(State8080 *));
+  fleet->count = count;
+  fleet->tasks = (count + BATCH_GROUP - 1) / BATCH_GROUP;
+  fleet->batches = malloc(fleet->tasks * sizeof(Batch8080 *));
+  fleet->pool = MemoryPoolNew(model->memory, count);
+  for (int t = 0; t < fleet->tasks; t++) {
+    int first = t * BATCH_GROUP;
+    int lanes = count - first < BATCH_GROUP ? count - first : BATCH_GROUP;
+    fleet->batches[t] = BatchNewInPool(model, lanes, fleet->pool);
+    fleet->batches[t]->shared_pool = 1;
+    for (int k = 0; k < lanes; k++)
+      fleet->machines[first + k] = fleet->batches[t]->lanes[k];
+  }
+  FleetStart(fleet, threads);
+  return fleet;
+}
+
+// Whether any machine is still short of `end` and able to get there
+static int FleetRunning(const Fleet *fleet) {
+  for (int i = 0; i < fleet->count; i++) {
+    const State8080 *state = fleet->machines[i];
+    if (!(state->halted && !state->int_enable) && state->cycles < fleet->end)
+      return 1;
+  }
+  return 0;
+}
+
+/**
+ * Runs every machine a frame at a time until it reaches cycle `end`, as
+ * main's loop runs a single machine. Each frame is shared out evenly
+ * between the workers, and one that runs out of machines steals from the
+ * others, so a few slow machines do not hold up the frame.
+ */
+void FleetRun(Fleet *fleet, uint64_t end) {
+  fleet->end = end;
+  while (FleetRunning(fleet)) {
+    for (int w = 0; w < fleet->threads; w++) {
+      uint64_t next = (uint64_t) fleet->tasks * w / fleet->threads;
+      uint64_t end = (uint64_t) fleet->tasks * (w + 1) / fleet->threads;
+      atomic_store(&fleet->queues[w].range, next | end << 32);
+    }
+    pthread_barrier_wait(&fleet->start);
+    FleetWork(fleet, 0);
+    pthread_barrier_wait(&fleet->done);
+    fleet->frame++;
+  }
+}
+
+void FleetFree(Fleet *fleet) {
+  fleet->quit = 1;
+  pthread_barrier_wait(&fleet->start);
+  for (int w = 1; w < fleet->threads; w++)
+    pthread_join(fleet->workers[w], NULL);
+  pthread_barrier_destroy(&fleet->start);
+  pthread_barrier_destroy(&fleet->done);
+  if (fleet->batches != NULL) {
+    for (int t = 0; t < fleet->tasks; t++)
+      BatchFree(fleet->batches[t]);
+    free(fleet->batches);
+  } else {
+    for (int i = 0; i < fleet->count; i++)
+      Free8080(fleet->machines[i]);
+  }
+  MemoryPoolFree(fleet->pool);
+  free(fleet->machines);
+  free(fleet->queues);
+  free(fleet->workers);
+  free(fleet);
+}
+
+static double Seconds(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// Frame-time histogram buckets for --realtime: 0.1 ms of error each, the
+// last one for 2 ms and over
+#define PACER_BUCKETS 21
+// Least time to spin before a deadline rather than sleep
+#define PACER_SPIN    1e-3
+
+/**
+ * Paces a machine to the wall clock for --realtime. Each frame is presented
+ * at its deadline on the monotonic clock: the pacer sleeps until just
+ * before it and spins the rest of the way, since a sleep can wake late. The
+ * frame's second half is run as late as the pacer dares, just in time to
+ * make the deadline, so that inputs read during it are as fresh as
+ * possible. It keeps a histogram of how far each frame-to-frame interval
+ * was from 1/60 s.
+ */
+typedef struct Pacer {
+  double    period;
+  double    deadline;   // when the current frame is due
+  double    last;       // when the last frame was presented, 0 before any
+  double    cost;       // how long a half frame takes to run, a guess
+  // How long before a deadline to stop sleeping: PACER_SPIN, or more if
+  // sleeps have been waking up later than that lately
+  double    spin;
+  uint64_t  frames;
+  uint64_t  late;       // presented over 0.1 ms after their deadline
+  uint64_t  resyncs;    // fell a whole frame behind and started over
+  // Presentation time minus deadline, last and worst
+  double    drift;
+  double    drift_max;
+  // |interval - period|, over every interval
+  double    jitter_sum;
+  double    jitter_max;
+  uint32_t  histogram[PACER_BUCKETS];
+} Pacer;
+
+void PacerStart(Pacer *pacer, double hz) {
+  memset(pacer, 0, sizeof(Pacer));
+  pacer->period = 1.0 / hz;
+  pacer->deadline = Seconds() + pacer->period;
+  pacer->cost = 1e-3;
+  pacer->spin = PACER_SPIN;
+}
+
+// Sleeps until `spin` before `t`, then spins until `t`. A sleep that
+// overslept widens `spin` to half as much again as it overslept, and it
+// narrows back slowly.
+static void PacerWaitUntil(Pacer *pacer, double t) {
+  double now = Seconds();
+  if (t - now > pacer->spin) {
+    double wake = t - pacer->spin;
+    struct timespec ts = { (time_t) wake,
+                           (long) ((wake - (time_t) wake) * 1e9) };
+    // A signal cuts the sleep short; any other error leaves it to the spin
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+      ;
+    double over = 1.5 * (Seconds() - wake);
+    if (over > pacer->spin)
+      pacer->spin = over < pacer->period / 4 ? over : pacer->period / 4;
+    else if (pacer->spin > PACER_SPIN)
+      pacer->spin *= 0.999;
+  }
+  while (Seconds() < t)
+    ;
+}
+
+/**
+ * Waits until it is time to start the frame's last `cost` of work: twice
+ * the guessed time of a half frame before the deadline, to leave room for
+ * a slow one.
+ */
+void PacerWaitForLateHalf(Pacer *pacer) {
+  PacerWaitUntil(pacer, pacer->deadline - 2 * pacer->cost);
+}
+
+/**
+ * Tells the pacer how long the late half took. The guess follows a slower
+ * half at once and a faster one gradually.
+ */
+void PacerHalfTook(Pacer *pacer, double took) {
+  pacer->cost = took > pacer->cost ? took : 0.95 * pacer->cost + 0.05 * took;
+}
+
+/**
+ * Waits for the frame's deadline, counts it as presented then, and moves
+ * on to the next frame. A frame that missed its deadline is presented
+ * straight away; one more than a frame late puts the deadlines back in step
+ * with the clock rather than rushing through the frames it missed.
+ */
+void PacerPresent(Pacer *pacer) {
+  PacerWaitUntil(pacer, pacer->deadline);
+  double now = Seconds();
+  pacer->drift = now - pacer->deadline;
+  if (pacer->drift > pacer->drift_max)
+    pacer->drift_max = pacer->drift;
+  if (pacer->drift > 1e-4)
+    pacer->late++;
+  if (pacer->last != 0) {
+    double jitter = now - pacer->last - pacer->period;
+    if (jitter < 0)
+      jitter = -jitter;
+    int bucket = jitter * 1e4;
+    pacer->histogram[bucket < PACER_BUCKETS ? bucket : PACER_BUCKETS - 1]++;
+    pacer->jitter_sum += jitter;
+    if (jitter > pacer->jitter_max)
+      pacer->jitter_max = jitter;
+  }
+  pacer->last = now;
+  pacer->frames++;
+  pacer->deadline += pacer->period;
+  if (now - pacer->deadline > 0) {
+    pacer->deadline = now + pacer->period;
+    pacer->resyncs++;
+  }
+}
+
+void PacerReport(const Pacer *pacer) {
+  uint64_t intervals = pacer->frames > 0 ? pacer->frames - 1 : 0;
+  printf("%llu frames at %.0f Hz: %llu late, %llu resyncs, drift now "
+         "%.3f ms (worst %.3f ms), jitter mean %.3f ms, max %.3f ms, "
+         "spinning %.2f ms\n",
+         (unsigned long long) pacer->frames, 1 / pacer->period,
+         (unsigned long long) pacer->late, (unsigned long long) pacer->resyncs,
+         pacer->drift * 1e3, pacer->drift_max * 1e3,
+         intervals ? pacer->jitter_sum / intervals * 1e3 : 0.0,
+         pacer->jitter_max * 1e3, pacer->spin * 1e3);
+  for (int i = 0; i < PACER_BUCKETS; i++) {
+    if (pacer->histogram[i] == 0)
+      continue;
+    if (i < PACER_BUCKETS - 1)
+      printf("  %.1f-%.1f ms %10u\n", i / 10.0, (i + 1) / 10.0,
+             pacer->histogram[i]);
+    else
+      printf("  %.1f+ ms    %10u\n", i / 10.0, pacer->histogram[i]);
+  }
+}
+
+/*
+ * Sound. On the cabinet each sound is an analog circuit that a bit of port
+ * 3 or 5 sets off; here each is a sample, numbered as MAME's samples for
+ * the game are: 0 UFO, 1 shot, 2 player death, 3 invader death, 4-7 the
+ * fleet's four steps, 8 UFO hit, 9 extra ship.
+ */
+#define SOUND_RATE      44100  // output samples per second
+#define SOUND_SAMPLES   10
+#define SOUND_UFO       0      // loops for as long as its bit is set
+#define SOUND_AMP       0x20   // port 3: amplifier on, off in the attract mode
+#define SOUND_CHUNK     1024   // samples mixed and written at a time
+
+// Which sample each bit of ports 3 and 5 sets off, -1 for none
+static const int8_t SoundForBit[2][8] = {
+  { 0, 1, 2, 3, 9, -1, -1, -1 },
+  { 4, 5, 6, 7, 8, -1, -1, -1 },
+};
+
+// Stand-ins for samples that are not found: a square wave at `hz`, or
+// noise for 0, fading out over `ms`
+static const struct { uint16_t hz, ms; } SoundStandIns[SOUND_SAMPLES] = {
+  { 600, 150 }, { 0, 250 }, { 0, 1000 }, { 0, 300 },
+  { 110, 100 }, { 98, 100 }, { 87, 100 }, { 82, 100 },
+  { 0, 600 }, { 1200, 800 },
+};
+
+/**
+ * Turns one machine's sound events into 16-bit mono PCM on a thread of its
+ * own, and writes that to a WAV file. The CPU's side is SoundPush, from the
+ * OUT handler, and MixerTick, once a slice, which tells the mixer how far
+ * emulated time has got so that it can render up to there while nothing
+ * changes. Each event lands on the sample its cycle falls on, so the
+ * output is the same however far behind the mixer runs, as long as the
+ * ring does not fill up.
+ */
+typedef struct Mixer {
+  SoundRing  ring;
+  int16_t   *sample[SOUND_SAMPLES];
+  uint32_t   length[SOUND_SAMPLES];
+  int        loaded;       // samples read from files, not stand-ins
+  // The rest is the mixer thread's. How far each sample has played,
+  // `length` when it is not playing.
+  uint32_t   pos[SOUND_SAMPLES];
+  uint8_t    latch[2];     // ports 3 and 5 as of the last event
+  uint64_t   start;        // cycle the first output sample stands for
+  uint64_t   rendered;     // output samples so far
+  uint64_t   events;       // port writes mixed in
+  uint64_t   ticks;
+  // From a tick being sent to its samples being written, in seconds
+  double     latency_sum;
+  double     latency_max;
+  FILE      *out;
+  pthread_t  thread;
+  _Atomic int stop;
+} Mixer;
+
+/**
+ * Reads a PCM WAV file of 8 or 16 bits as mono at SOUND_RATE: the first
+ * channel, taking the nearest sample for each output one. Returns NULL if
+ * the file is missing or not such a WAV.
+ */
+static int16_t* SoundLoadWav(const char *filename, uint32_t *length) {
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL)
+    return NULL;
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  uint8_t *file = malloc(size > 0 ? size : 1);
+  size_t got = size > 0 ? fread(file, 1, size, f) : 0;
+  fclose(f);
+  const uint8_t *p = file + 12, *end = file + got;
+  if (got < 12 || memcmp(file, "RIFF", 4) != 0 ||
+      memcmp(file + 8, "WAVE", 4) != 0)
+    p = end;
+  int16_t *pcm = NULL;
+  uint32_t channels = 0, rate = 0, bits = 0;
+  while (pcm == NULL && end - p >= 8) {
+    const uint8_t *q = p + 4, *data = p + 8;
+    uint32_t chunk = Get(&q, 4);
+    if (chunk > (size_t) (end - data))
+      chunk = end - data;
+    if (memcmp(p, "fmt ", 4) == 0 && chunk >= 16) {
+      q = data;
+      int format = Get(&q, 2);
+      channels = format == 1 ? Get(&q, 2) : 0;
+      rate = Get(&q, 4);
+      q += 6;
+      bits = Get(&q, 2);
+    } else if (memcmp(p, "data", 4) == 0 && channels > 0 && rate > 0 &&
+               (bits == 8 || bits == 16)) {
+      uint32_t frame = channels * bits / 8;
+      uint32_t n = (uint64_t) (chunk / frame) * SOUND_RATE / rate;
+      pcm = malloc((n + 1) * sizeof(int16_t));
+      for (uint32_t i = 0; i < n; i++) {
+        const uint8_t *x = data + (uint64_t) i * rate / SOUND_RATE * frame;
+        pcm[i] = bits == 8 ? (x[0] - 128) * 256 : (int16_t) (x[0] | x[1] << 8);
+      }
+      *length = n;
+    }
+    p = data + chunk + (chunk & 1);
+  }
+  free(file);
+  return pcm;
+}
+
+static int16_t* SoundStandIn(int index, uint32_t *length) {
+  uint32_t n = SOUND_RATE * SoundStandIns[index].ms / 1000;
+  uint32_t hz = SoundStandIns[index].hz, noise = 1;
+  int16_t *pcm = malloc(n * sizeof(int16_t));
+  for (uint32_t i = 0; i < n; i++) {
+    int level = 8000 * (n - i) / n, high;
+    if (hz != 0) {
+      high = (uint64_t) i * hz * 2 / SOUND_RATE & 1;
+    } else {
+      noise = noise * 1103515245 + 12345;
+      high = noise >> 30 & 1;
+    }
+    pcm[i] = high ? level : -level;
+  }
+  *length = n;
+  return pcm;
+}
+
+// Starts the samples whose bits went from 0 to 1, and stops the UFO if its
+// bit went to 0
+static void MixerApply(Mixer *mixer, const SoundEvent *e) {
+  int k = e->port == 5;
+  uint8_t rose = e->value & ~mixer->latch[k];
+  for (int bit = 0; bit < 8; bit++)
+    if (SoundForBit[k][bit] >= 0 && (rose >> bit & 1))
+      mixer->pos[SoundForBit[k][bit]] = 0;
+  if (k == 0 && !(e->value & 1))
+    mixer->pos[SOUND_UFO] = mixer->length[SOUND_UFO];
+  mixer->latch[k] = e->value;
+  mixer->events++;
+}
+
+// Mixes and writes out the samples up to the one `cycle` falls on
+static void MixerRender(Mixer *mixer, uint64_t cycle) {
+  int16_t buf[SOUND_CHUNK];
+  uint64_t until = cycle > mixer->start
+                   ? (cycle - mixer->start) * SOUND_RATE / CPU_HZ : 0;
+  while (mixer->rendered < until) {
+    int n = until - mixer->rendered < SOUND_CHUNK
+            ? until - mixer->rendered : SOUND_CHUNK;
+    for (int i = 0; i < n; i++) {
+      int sum = 0;
+      for (int k = 0; k < SOUND_SAMPLES; k++) {
+        if (mixer->pos[k] == mixer->length[k])
+          continue;
+        sum += mixer->sample[k][mixer->pos[k]++];
+        if (mixer->pos[k] == mixer->length[k] && k == SOUND_UFO &&
+            (mixer->latch[0] & 1))
+          mixer->pos[k] = 0;
+      }
+      if (!(mixer->latch[0] & SOUND_AMP))
+        sum = 0;
+      buf[i] = sum < -32768 ? -32768 : sum > 32767 ? 32767 : sum;
+    }
+    // WAV is little-endian, as is every host this builds on
+    fwrite(buf, sizeof(int16_t), n, mixer->out);
+    mixer->rendered += n;
+  }
+}
+
+static void *MixerThread(void *arg) {
+  Mixer *mixer = arg;
+  SoundRing *ring = &mixer->ring;
+  uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  for (;;) {
+    // Anything pushed before the stop is in the ring by now
+    int stopping = atomic_load(&mixer->stop);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail == head) {
+      if (stopping)
+        return NULL;
+      // Look again in a millisecond, well inside a frame
+      struct timespec ts = { 0, 1000000 };
+      nanosleep(&ts, NULL);
+      continue;
+    }
+    for (; tail != head; tail++) {
+      const SoundEvent *e = &ring->events[tail & (SOUND_RING_SIZE - 1)];
+      MixerRender(mixer, e->cycle);
+      if (e->port != 0) {
+        MixerApply(mixer, e);
+        continue;
+      }
+      double latency = Seconds() - e->wall;
+      mixer->latency_sum += latency;
+      if (latency > mixer->latency_max)
+        mixer->latency_max = latency;
+      mixer->ticks++;
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+  }
+}
+
+/**
+ * Starts mixing `state`'s sound into the WAV file `filename`, from the
+ * samples 0.wav to 9.wav in the directory `samples`. A stand-in tone is
+ * used for any that cannot be read, and for all of them if `samples` is
+ * NULL. Returns NULL if the file cannot be written.
+ */
+Mixer* MixerNew(State8080 *state, const char *filename, const char *samples) {
+  FILE *out = fopen(filename, "wb");
+  if (out == NULL) {
+    printf("error: Couldn't open %s\n", filename);
+    return NULL;
+  }
+  Mixer *mixer = aligned_alloc(_Alignof(Mixer), sizeof(Mixer));
+  memset(mixer, 0, sizeof(Mixer));
+  for (int i = 0; i < SOUND_SAMPLES; i++) {
+    char name[1024];
+    if (samples != NULL) {
+      snprintf(name, sizeof(name), "%s/%d.wav", samples, i);
+      mixer->sample[i] = SoundLoadWav(name, &mixer->length[i]);
+    }
+    if (mixer->sample[i] != NULL)
+      mixer->loaded++;
+    else
+      mixer->sample[i] = SoundStandIn(i, &mixer->length[i]);
+    mixer->pos[i] = mixer->length[i];
+  }
+  memcpy(mixer->latch, state->io.sound, 2);
+  mixer->start = state->cycles;
+  mixer->out = out;
+  // Room for the header, which MixerClose fills in once the size is known
+  static const uint8_t header[44];
+  fwrite(header, 1, sizeof(header), out);
+  state->sound = &mixer->ring;
+  pthread_create(&mixer->thread, NULL, MixerThread, mixer);
+  return mixer;
+}
+
+// Tells the mixer that emulated time has got to state->cycles
+void MixerTick(Mixer *mixer, const State8080 *state) {
+  SoundPush(&mixer->ring, state->cycles, Seconds(), 0, 0);
+}
+
+/**
+ * Mixes what is left, up to state->cycles, waits for the mixer thread to
+ * finish and completes the WAV file. The machine makes no sound after this.
+ */
+void MixerClose(Mixer *mixer, State8080 *state) {
+  atomic_store(&mixer->stop, 1);
+  pthread_join(mixer->thread, NULL);
+  state->sound = NULL;
+  // The thread is done with the ring and the voices: finish on this one
+  MixerRender(mixer, state->cycles);
+  uint32_t data = mixer->rendered * sizeof(int16_t);
+  uint8_t header[44], *p = header;
+  memcpy(p, "RIFF", 4);
+  p = Put(p + 4, 36 + data, 4);
+  memcpy(p, "WAVEfmt ", 8);
+  p = Put(p + 8, 16, 4);
+  p = Put(p, 1, 2);  // PCM
+  p = Put(p, 1, 2);  // mono
+  p = Put(p, SOUND_RATE, 4);
+  p = Put(p, SOUND_RATE * sizeof(int16_t), 4);
+  p = Put(p, sizeof(int16_t), 2);
+  p = Put(p, 16, 2);
+  memcpy(p, "data", 4);
+  Put(p + 4, data, 4);
+  fseek(mixer->out, 0, SEEK_SET);
+  fwrite(header, 1, sizeof(header), mixer->out);
+  fclose(mixer->out);
+  mixer->out = NULL;
+}
+
+void MixerReport(const Mixer *mixer) {
+  printf("sound: %.1f s from %llu port writes, %llu dropped, %d of %d "
+         "samples loaded; latency mean %.3f ms, max %.3f ms\n",
+         (double) mixer->rendered / SOUND_RATE,
+         (unsigned long long) mixer->events,
+         (unsigned long long) mixer->ring.dropped, mixer->loaded,
+         SOUND_SAMPLES,
+         mixer->ticks ? mixer->latency_sum / mixer->ticks * 1e3 : 0.0,
+         mixer->latency_max * 1e3);
+}
+
+void MixerFree(Mixer *mixer) {
+  for (int i = 0; i < SOUND_SAMPLES; i++)
+    free(mixer->sample[i]);
+  free(mixer);
+}
+
+/*
+ * Frames, from the emulation thread to a presentation thread that shows,
+ * encodes or sends them at its own pace.
+ */
+#define FRAME_FRESH 4  // in TripleBuffer.middle: a frame not yet taken
+
+/**
+ * Three RGBA frames passed from one producer to one consumer with no lock.
+ * The producer draws in `back` and the consumer reads `front`, and each
+ * hands its buffer over by swapping it with the one in `middle`, so
+ * neither ever waits for the other. A frame the producer publishes over
+ * one the consumer has not taken yet replaces it: the older frame is
+ * dropped, and the consumer always gets the newest.
+ *
+ * The producer only redraws the strips of the screen that changed since
+ * it last drew in the same buffer, as RenderDirtyFrameRGBA does with one.
+ */
+typedef struct TripleBuffer {
+  uint32_t   *frames[3];
+  uint64_t    number[3];  // the frame each buffer holds, counted from reset
+  // The producer's: the buffer it draws in, the strips each buffer is
+  // behind by, and counts
+  int         back;
+  uint32_t    stale[3];
+  uint64_t    published;
+  uint64_t    dropped;
+  // The buffer in between, plus FRAME_FRESH
+  _Alignas(64) _Atomic uint32_t middle;
+  // The consumer's
+  _Alignas(64) int front;
+  uint64_t    taken;
+} TripleBuffer;
+
+TripleBuffer* TripleBufferNew(void) {
+  TripleBuffer *tb = aligned_alloc(_Alignof(TripleBuffer),
+                                   sizeof(TripleBuffer));
+  memset(tb, 0, sizeof(TripleBuffer));
+  for (int i = 0; i < 3; i++) {
+    tb->frames[i] = calloc(SCREEN_WIDTH * SCREEN_HEIGHT, sizeof(uint32_t));
+    // Nothing drawn yet
+    tb->stale[i] = (1u << STRIP_COUNT) - 1;
+  }
+  tb->back = 0;
+  atomic_init(&tb->middle, 1);
+  tb->front = 2;
+  return tb;
+}
+
+/**
+ * Draws the screen as it is now into the back buffer and publishes it. It
+ * takes the dirty marks of video RAM, as RenderDirtyFrameRGBA does, so a
+ * machine can only be drawn by one of them.
+ */
+void TripleBufferPublish(TripleBuffer *tb, State8080 *state) {
+  uint32_t strips = TakeDirtyStrips(state);
+  for (int i = 0; i < 3; i++)
+    tb->stale[i] |= strips;
+  RenderStripSetRGBA(&state->memory[VRAM_START], tb->frames[tb->back],
+                     tb->stale[tb->back]);
+  tb->stale[tb->back] = 0;
+  tb->number[tb->back] = state->cycles / FRAME_CYCLES;
+  uint32_t old = atomic_exchange_explicit(&tb->middle, tb->back | FRAME_FRESH,
+                                          memory_order_acq_rel);
+  tb->dropped += (old & FRAME_FRESH) != 0;
+  tb->back = old & 3;
+  tb->published++;
+}
+
+/**
+ * Takes the newest frame, if one has been published since the last call,
+ * and sets `number` to which it is. Returns NULL if there is none. The
+ * frame stays put until the next call.
+ */
+const uint32_t* TripleBufferTake(TripleBuffer *tb, uint64_t *number) {
+  if (!(atomic_load_explicit(&tb->middle, memory_order_relaxed) & FRAME_FRESH))
+    return NULL;
+  tb->front = atomic_exchange_explicit(&tb->middle, tb->front,
+                                       memory_order_acq_rel) & 3;
+  tb->taken++;
+  *number = tb->number[tb->front];
+  return tb->frames[tb->front];
+}
+
+void TripleBufferFree(TripleBuffer *tb) {
+  for (int i = 0; i < 3; i++)
+    free(tb->frames[i]);
+  free(tb);
+}
+
+/**
+ * Stand-in for a window, an encoder or a network stream: a thread that
+ * takes frames from a TripleBuffer as they come and appends each to a
+ * file as a PPM image, which ffmpeg reads with -f image2pipe. Whatever it
+ * is too slow for is dropped, never waited on.
+ */
+typedef struct Presenter {
+  TripleBuffer *frames;
+  FILE        *out;
+  // The number of the last frame written, the thread's
+  uint64_t     last;
+  pthread_t    thread;
+  _Atomic int  stop;
+} Presenter;
+
+// How long the presenter sleeps when there is no new frame: a quarter of a
+// frame, so that at 60 frames a second each one is written well before the
+// next replaces it
+#define PRESENT_POLL_NS (1000000000 / FRAME_HZ / 4)
+
+static void *PresenterThread(void *arg) {
+  Presenter *p = arg;
+  for (;;) {
+    // The buffer keeps only the newest frame, so once the stop is seen the
+    // last frame published is either fresh in it now or already written
+    int stopping = atomic_load(&p->stop);
+    uint64_t number;
+    const uint32_t *frame = TripleBufferTake(p->frames, &number);
+    if (frame == NULL) {
+      if (stopping)
+        return NULL;
+      struct timespec ts = { 0, PRESENT_POLL_NS };
+      nanosleep(&ts, NULL);
+      continue;
+    }
+    PutFramePPM(p->out, frame);
+    p->last = number;
+  }
+}
+
+/**
+ * Starts a presentation thread writing to the file `filename`. Returns
+ * NULL if it cannot be written.
+ */
+Presenter* PresenterNew(const char *filename) {
+  FILE *out = fopen(filename, "wb");
+  if (out == NULL) {
+    printf("error: Couldn't open %s\n", filename);
+    return NULL;
+  }
+  Presenter *p = calloc(1, sizeof(Presenter));
+  p->frames = TripleBufferNew();
+  p->out = out;
+  pthread_create(&p->thread, NULL, PresenterThread, p);
+  return p;
+}
+
+// Lets the thread write the last frame, if it has not, and stops it
+void PresenterClose(Presenter *p) {
+  atomic_store(&p->stop, 1);
+  pthread_join(p->thread, NULL);
+  fclose(p->out);
+  p->out = NULL;
+}
+
+void PresenterReport(const Presenter *p) {
+  printf("video: %llu frames published, %llu presented, %llu dropped, "
+         "last presented frame %llu\n",
+         (unsigned long long) p->frames->published,
+         (unsigned long long) p->frames->taken,
+         (unsigned long long) p->frames->dropped,
+         (unsigned long long) p->last);
+}
+
+void PresenterFree(Presenter *p) {
+  TripleBufferFree(p->frames);
+  free(p);
+}
+
+// Fleet-style input callback for the gameplay benchmark: a coin, one
+// player start, then the cannon weaving left and right, firing all along.
+// `frame` counts from reset.
+static void BenchPlayInput(State8080 *state, int index, uint64_t frame,
+                           void *user) {
+  (void) index;
+  (void) user;
+  uint8_t in = 0x08;  // always reads 1, see MidwayResetIO
+  if (frame >= 60 && frame < 66) {
+    in |= INPUT_COIN;
+  } else if (frame >= 120 && frame < 126) {
+    in |= INPUT_P1_START;
+  } else if (frame >= 180) {
+    in |= (frame >> 6) & 1 ? INPUT_RIGHT : INPUT_LEFT;
+    if (frame % 16 < 4)
+      in |= INPUT_SHOT;
+  }
+  state->io.in_port[1] = in;
+}
+
+// The copy benchmark: a stub in work RAM that copies the ROM over video
+// RAM forever, 256 bytes at a time through the game's own block copy at
+// 1A32, with interrupts off
+static void BenchCopySetup(State8080 *state) {
+  static const uint8_t stub[] = {
+    0xf3,             // 2100 DI
+    0x31, 0x00, 0x24, // 2101 LXI SP,2400
+    0x11, 0x00, 0x00, // 2104 LXI D,0000
+    0x21, 0x00, 0x24, // 2107 LXI H,2400
+    0x0e, 0x1c,       // 210a MVI C,1C      28 blocks, all of video RAM
+    0x06, 0x00,       // 210c MVI B,00      256 bytes
+    0xcd, 0x32, 0x1a, // 210e CALL 1A32
+    0x0d,             // 2111 DCR C
+    0xc2, 0x0c, 0x21, // 2112 JNZ 210C
+    0xc3, 0x04, 0x21, // 2115 JMP 2104
+  };
+  for (size_t i = 0; i < sizeof(stub); i++)
+    WriteByte(state, 0x2100 + i, stub[i]);
+  state->pc = 0x2100;
+}
+
+/**
+ * The standard benchmarks. Each starts from reset, runs a fixed number of
+ * frames with no screen, trace or throttle, and must end with the RAM
+ * (video RAM included) hashing to `hash`, so that an engine cannot get
+ * faster by getting something wrong. `instructions` is how many the
+ * reference engine runs in that time, for the ns per instruction figure.
+ * Both come from Run8080 and need redoing if a workload changes.
+ */
+typedef struct BenchWorkload {
+  const char   *name;
+  const char   *title;
+  uint64_t      frames;
+  void        (*setup)(State8080 *state);  // may be NULL
+  FleetFrameFn  input;                     // may be NULL
+  uint64_t      instructions;
+  uint32_t      hash;
+} BenchWorkload;
+
+static const BenchWorkload BenchWorkloads[] = {
+  { "attract", "attract mode, no inputs", 3600, NULL, NULL,
+    13673674, 0xd77803b2 },
+  { "play", "coin, start and a scripted game", 3600, NULL, BenchPlayInput,
+    15748473, 0x5d22caec },
+  { "copy", "ROM to video RAM block copy", 600, BenchCopySetup, NULL,
+    3071710, 0x47e25ccf },
+};
+#define BENCH_WORKLOADS (int) (sizeof(BenchWorkloads) / sizeof(BenchWorkload))
+// Each workload is timed this many times and the fastest run counts
+#define BENCH_RUNS 3
+
+// Runs a workload once on a copy of `model`, in half-frame slices as main
+// does, and returns how long it took. `frames` is less than asked for if
+// the machine stopped on a fault.
+static double BenchRunOnce(const BenchWorkload *w, const State8080 *model,
+                           Backend8080 run, uint32_t *hash, uint64_t *cycles,
+                           uint64_t *frames) {
+  State8080 *state = Clone8080(model);
+  if (w->setup != NULL)
+    w->setup(state);
+  double start = Seconds();
+  uint64_t f;
+  for (f = 0; f < w->frames; f++) {
+    if (state->halted && !state->int_enable)
+      break;
+    if (w->input != NULL)
+      w->input(state, 0, f, NULL);
+    for (int half = 0; half < 2; half++)
+      RunHalfFrame8080(state, run);
+  }
+  double took = Seconds() - start;
+  *hash = RamHash(state->memory);
+  *cycles = state->cycles - model->cycles;
+  *frames = f;
+  Free8080(state);
+  return took;
+}
+
+/**
+ * Runs the workload `only` (every one if NULL) on `run` from `model`, a
+ * machine just reset with its ROMs loaded, and prints a line for each.
+ * Returns the number whose hash did not match.
+ */
+int RunBenchmarks(const State8080 *model, Backend8080 run, const char *only) {
+  int bad = 0, found = 0;
+  for (int i = 0; i < BENCH_WORKLOADS; i++) {
+    const BenchWorkload *w = &BenchWorkloads[i];
+    if (only != NULL && strcmp(only, w->name) != 0)
+      continue;
+    if (!found)
+      printf("ns/instruction is per instruction of the reference (Run8080), "
+             "whatever the core\n");
+    found = 1;
+    double best = 0;
+    uint32_t hash = 0;
+    uint64_t cycles = 0, frames = 0;
+    for (int k = 0; k < BENCH_RUNS; k++) {
+      double took = BenchRunOnce(w, model, run, &hash, &cycles, &frames);
+      if (k == 0 || took < best)
+        best = took;
+    }
+    // A run cut short by a fault did not do the work the rates assume
+    if (frames < w->frames) {
+      printf("%-8s %6llu frames of %llu, then stopped on a fault: FAILED\n",
+             w->name, (unsigned long long) frames,
+             (unsigned long long) w->frames);
+      bad++;
+      continue;
+    }
+    printf("%-8s %6llu frames %8.2f ns/instruction %9.1f MHz %9.0f frames/s"
+           "  hash %08x %s\n", w->name, (unsigned long long) frames,
+           best * 1e9 / w->instructions, cycles / best / 1e6,
+           frames / best, hash, hash == w->hash ? "ok" : "MISMATCH");
+    bad += hash != w->hash;
+  }
+  if (!found) {
+    printf("error: Unknown benchmark %s, the choices are:\n", only);
+    for (int i = 0; i < BENCH_WORKLOADS; i++)
+      printf("  %-8s %s\n", BenchWorkloads[i].name, BenchWorkloads[i].title);
+    return 1;
+  }
+  return bad;
+}
+
+// The engines --diff can compare, by the names --core knows them by
+static const struct {
+  const char  *name;
+  Backend8080  run;
+} DiffBackends[] = {
+  { "threaded", Run8080 },
+  { "cached", RunCached8080 },
+  { "switch", RunSwitch8080 },
+  { "profiled", RunProfiled8080 },
+};
+#define DIFF_BACKENDS (int) (sizeof(DiffBackends) / sizeof(DiffBackends[0]))
+
+// Memory is compared every this many steps and at the end of each fuzz
+// case, registers after every step
+#define DIFF_MEMORY_EVERY 64
+// Steps of random code per fuzz case, unless it halts first
+#define DIFF_CASE_STEPS   1024
+// Fresh random bytes written at the start of each fuzz case
+#define DIFF_CASE_CODE    64
+
+/**
+ * Two engines run in lockstep by RunDiff. Both machines start as copies of
+ * `model` and get the same cycle budget for each step; after every step
+ * their registers must match, and every DIFF_MEMORY_EVERY steps so must
+ * every 32-byte block either of them wrote since the last such check.
+ */
+typedef struct Diff {
+  const State8080 *model;
+  Backend8080  run[2];
+  const char  *name[2];
+  int          step;         // cycle budget of each step, 1 for an instruction
+  uint64_t     cycles;       // how long to run
+  int          fuzz;         // run random code rather than the game
+  uint64_t     seed;
+  // Filled in by DiffSession
+  uint64_t     steps;
+  uint64_t     cases;
+  uint64_t     clean;        // steps when memory last matched
+  uint64_t     found;        // cycle the difference was seen at, 0 for none
+  char         what[96];     // what differed
+} Diff;
+
+static uint64_t DiffRandom(uint64_t *x) {
+  // xorshift64*
+  *x ^= *x >> 12;
+  *x ^= *x << 25;
+  *x ^= *x >> 27;
+  return *x * 0x2545f4914f6cdd1dULL;
+}
+
+static int DiffPSW(const State8080 *state) {
+  return LazyFlagsPSW(LazyFlagsFromCC(state->cc));
+}
+
+/**
+ * Returns 1 and says in diff->what how `a` and `b` first differ, or returns
+ * 0. With `memory` it also compares the blocks marked dirty in either, and
+ * clears the marks for the next time.
+ */
+static int DiffCompare(Diff *diff, State8080 *a, State8080 *b, int memory) {
+#define DIFF_FIELD(f, fmt)                                                 \
+  if (a->f != b->f) {                                                      \
+    snprintf(diff->what, sizeof(diff->what), #f " " fmt " vs " fmt,        \
+             a->f, b->f);                                                  \
+    return 1;                                                              \
+  }
+  DIFF_FIELD(pc, "%04x") DIFF_FIELD(sp, "%04x")
+  DIFF_FIELD(a, "%02x") DIFF_FIELD(b, "%02x") DIFF_FIELD(c, "%02x")
+  DIFF_FIELD(d, "%02x") DIFF_FIELD(e, "%02x") DIFF_FIELD(h, "%02x")
+  DIFF_FIELD(l, "%02x")
+  DIFF_FIELD(int_enable, "%d") DIFF_FIELD(halted, "%d")
+  DIFF_FIELD(fault, "%d")
+  DIFF_FIELD(io.shift, "%04x") DIFF_FIELD(io.shift_offset, "%d")
+  DIFF_FIELD(io.sound[0], "%02x") DIFF_FIELD(io.sound[1], "%02x")
+#undef DIFF_FIELD
+  if (a->cycles != b->cycles) {
+    snprintf(diff->what, sizeof(diff->what), "cycles %llu vs %llu",
+             (unsigned long long) a->cycles, (unsigned long long) b->cycles);
+    return 1;
+  }
+  if (DiffPSW(a) != DiffPSW(b)) {
+    snprintf(diff->what, sizeof(diff->what), "PSW %02x vs %02x", DiffPSW(a),
+             DiffPSW(b));
+    return 1;
+  }
+  if (!memory)
+    return 0;
+  // Eight marks at a time: nearly all of them are clear
+  for (size_t i = 0; i < sizeof(a->dirty); i += 8) {
+    uint64_t da, db;
+    memcpy(&da, &a->dirty[i], 8);
+    memcpy(&db, &b->dirty[i], 8);
+    if ((da | db) == 0)
+      continue;
+    for (int adr = i << 5; adr < (int) (i + 8) << 5; adr++) {
+      if (a->memory[adr] != b->memory[adr]) {
+        snprintf(diff->what, sizeof(diff->what), "memory at %04x %02x vs %02x",
+                 adr, a->memory[adr], b->memory[adr]);
+        return 1;
+      }
+    }
+  }
+  memset(a->dirty, 0, sizeof(a->dirty));
+  memset(b->dirty, 0, sizeof(b->dirty));
+  return 0;
+}
+
+// Starts the next fuzz case on both machines: random registers and flags,
+// interrupts off, and a fresh run of random code where pc now points
+static void DiffNewCase(State8080 *m[2], uint64_t *rng) {
+  uint64_t r = DiffRandom(rng), s = DiffRandom(rng);
+  uint8_t code[DIFF_CASE_CODE];
+  for (int i = 0; i < DIFF_CASE_CODE; i += 8) {
+    uint64_t x = DiffRandom(rng);
+    memcpy(&code[i], &x, 8);
+  }
+  for (int k = 0; k < 2; k++) {
+    State8080 *state = m[k];
+    state->a = r;
+    state->b = r >> 8;
+    state->c = r >> 16;
+    state->d = r >> 24;
+    state->e = r >> 32;
+    state->h = r >> 40;
+    state->l = r >> 48;
+    LazyFlagsToCC(LazyFlagsFromPSW(r >> 56), &state->cc);
+    state->sp = s;
+    state->pc = s >> 16;
+    state->int_enable = 0;
+    state->halted = 0;
+    state->fault = 0;
+    for (int i = 0; i < DIFF_CASE_CODE; i++)
+      WriteByte(state, state->pc + i, code[i]);
+  }
+}
+
+static void DiffPrintState(const char *name, const State8080 *state) {
+  printf("  %-8s A %02x B %02x C %02x D %02x E %02x H %02x L %02x PSW %02x "
+         "SP %04x PC %04x cycles %llu\n", name, state->a, state->b, state->c,
+         state->d, state->e, state->h, state->l, DiffPSW(state), state->sp,
+         state->pc, (unsigned long long) state->cycles);
+}
+
+/**
+ * Runs the whole session from the start, which the seed and the step make
+ * the same every time. From step `locate` on it goes one instruction at a
+ * time comparing everything, to find the instruction where a session that
+ * already failed first went wrong, and prints it. Returns 1 if the
+ * machines differed.
+ */
+static int DiffSession(Diff *diff, uint64_t locate) {
+  State8080 *m[2] = { Clone8080(diff->model), Clone8080(diff->model) };
+  uint64_t rng = diff->seed * 2 + 1;
+  if (diff->fuzz) {
+    // Random code everywhere and no interrupts
+    for (int adr = 0; adr < 0x10000; adr += 8) {
+      uint64_t x = DiffRandom(&rng);
+      memcpy(&m[0]->memory[adr], &x, 8);
+    }
+    memcpy(m[1]->memory, m[0]->memory, 0x10000);
+    for (int k = 0; k < 2; k++) {
+      m[k]->sched.count = 0;
+      memset(m[k]->dirty, 0, sizeof(m[k]->dirty));
+    }
+  }
+  uint64_t start = m[0]->cycles, steps = 0, case_steps = 0, unchecked = 0;
+  uint16_t pc = 0;
+  uint8_t code[3] = { 0 };
+  int locating = 0, differ = 0;
+  diff->cases = 0;
+  while (m[0]->cycles - start < diff->cycles) {
+    // With no events due in fuzz cases, HLT stops a machine whatever EI said
+    int stopped = m[0]->halted && m[1]->halted &&
+                  (diff->fuzz || (!m[0]->int_enable && !m[1]->int_enable));
+    if (!locating && diff->fuzz &&
+        (steps == 0 || case_steps == DIFF_CASE_STEPS || stopped)) {
+      // A case ends with its memory checked
+      if (unchecked > 0) {
+        if ((differ = DiffCompare(diff, m[0], m[1], 1)))
+          break;
+        diff->clean = steps;
+        unchecked = 0;
+      }
+      DiffNewCase(m, &rng);
+      diff->cases++;
+      case_steps = 0;
+    } else if (!locating && stopped) {
+      break;
+    }
+    if (!locating && unchecked == 0)
+      locating = steps >= locate;
+    if (locating) {
+      if (m[0]->cycles > diff->found)
+        break;
+      pc = m[0]->pc;
+      for (int i = 0; i < 3; i++)
+        code[i] = m[0]->memory[(uint16_t) (pc + i)];
+    }
+    int budget = locating ? 1 : diff->step;
+    RunScheduled8080(m[0], diff->run[0], budget);
+    RunScheduled8080(m[1], diff->run[1], budget);
+    steps++;
+    case_steps++;
+    int memory = locating || ++unchecked == DIFF_MEMORY_EVERY;
+    if ((differ = DiffCompare(diff, m[0], m[1], memory)))
+      break;
+    if (memory && !locating) {
+      diff->clean = steps;
+      unchecked = 0;
+    }
+  }
+  // The marks only cover what was written, so compare the lot once
+  if (!differ && !locating && memcmp(m[0]->memory, m[1]->memory, 0x10000)) {
+    for (int adr = 0; adr < 0x10000; adr++) {
+      if (m[0]->memory[adr] != m[1]->memory[adr]) {
+        snprintf(diff->what, sizeof(diff->what), "memory at %04x %02x vs %02x",
+                 adr, m[0]->memory[adr], m[1]->memory[adr]);
+        break;
+      }
+    }
+    differ = 1;
+  }
+  if (!locating) {
+    diff->steps = steps;
+    if (differ)
+      diff->found = m[0]->cycles > m[1]->cycles ? m[0]->cycles : m[1]->cycles;
+  } else if (differ) {
+    printf("first difference after\n  ");
+    Disassemble8080Bytes(code, pc);
+    printf("  %s\n", diff->what);
+    DiffPrintState(diff->name[0], m[0]);
+    DiffPrintState(diff->name[1], m[1]);
+  }
+  Free8080(m[0]);
+  Free8080(m[1]);
+  return differ;
+}
+
+// Where DiffMirrorCases put their code, and how long each may run
+#define DIFF_MIRROR_CODE   0x2200
+#define DIFF_MIRROR_CYCLES 20000
+
+// Loops the cached core fuses, each reading from a mirror image of bytes
+// it writes, for machines forked from a MemoryPool: their RAM is mapped
+// again at every mirror, so an address above 3FFF is a byte below it.
+static const struct {
+  const char *name;
+  uint16_t    bc, de, hl, sp;
+  uint8_t     code[16];
+} DiffMirrorCases[] = {
+  // LDAX D / MOV M,A / INX H / INX D / DCR B / JNZ from 6100 to 2101, so
+  // each byte copied is the next one read
+  { "block copy onto its own image", 0x4000, 0x6100, 0x2101, 0x2400,
+    { 0x1a, 0x77, 0x23, 0x13, 0x05, 0xc2, 0x00, 0x22, 0x76 } },
+  // The column copy, reading the BC it pushed through 63FE
+  { "column copy from the stack's image", 0x1005, 0x63fe, 0x2800, 0x2400,
+    { 0xc5, 0x1a, 0x77, 0x13, 0x01, 0x20, 0x00, 0x09, 0xc1, 0x05, 0xc2,
+      0x00, 0x22, 0x76 } },
+};
+#define DIFF_MIRROR_CASES \
+  (int) (sizeof(DiffMirrorCases) / sizeof(DiffMirrorCases[0]))
+
+/**
+ * Runs each of DiffMirrorCases on a pair of machines forked from a pool
+ * made from `diff->model`, with the RAM below the code filled in, until
+ * both halt. On the first case that differs it prints how, with both sets
+ * of registers, and returns 1.
+ */
+static int DiffMirrors(Diff *diff) {
+  MemoryPool *pool = MemoryPoolNew(diff->model->memory, 2);
+  int differ = 0;
+  for (int i = 0; i < DIFF_MIRROR_CASES && !differ; i++) {
+    State8080 *m[2];
+    for (int k = 0; k < 2; k++) {
+      State8080 *state = m[k] = Fork8080(diff->model, pool);
+      state->sched.count = 0;
+      state->int_enable = 0;
+      state->halted = 0;
+      for (int adr = ROM_SIZE; adr < DIFF_MIRROR_CODE; adr++)
+        state->memory[adr] = adr * 13 + 1;
+      memcpy(&state->memory[DIFF_MIRROR_CODE], DiffMirrorCases[i].code,
+             sizeof(DiffMirrorCases[i].code));
+      state->b = DiffMirrorCases[i].bc >> 8;
+      state->c = DiffMirrorCases[i].bc;
+      state->d = DiffMirrorCases[i].de >> 8;
+      state->e = DiffMirrorCases[i].de;
+      state->h = DiffMirrorCases[i].hl >> 8;
+      state->l = DiffMirrorCases[i].hl;
+      state->sp = DiffMirrorCases[i].sp;
+      state->pc = DIFF_MIRROR_CODE;
+      // In one go, so that the cached core runs the loop as one operation
+      RunScheduled8080(state, diff->run[k], DIFF_MIRROR_CYCLES);
+    }
+    // The memory was filled in behind the dirty marks, so compare the lot
+    differ = DiffCompare(diff, m[0], m[1], 0);
+    for (int adr = 0; !differ && adr < MIRROR_SIZE; adr++) {
+      if (m[0]->memory[adr] != m[1]->memory[adr]) {
+        snprintf(diff->what, sizeof(diff->what), "memory at %04x %02x vs %02x",
+                 adr, m[0]->memory[adr], m[1]->memory[adr]);
+        differ = 1;
+      }
+    }
+    if (differ) {
+      printf("%s and %s differ on a %s: %s\n", diff->name[0], diff->name[1],
+             DiffMirrorCases[i].name, diff->what);
+      DiffPrintState(diff->name[0], m[0]);
+      DiffPrintState(diff->name[1], m[1]);
+    }
+    Free8080(m[0]);
+    Free8080(m[1]);
+  }
+  MemoryPoolFree(pool);
+  return differ;
+}
+
+/**
+ * Runs engines `a` and `b` (names from DiffBackends) side by side from
+ * `model`, for `cycles` T-states of the game or, with `fuzz`, of random
+ * code from `seed`. Returns 0 if they agreed throughout, else reports the
+ * first instruction whose results differ and returns 1.
+ */
+int RunDiff(const State8080 *model, const char *a, const char *b, int step,
+            uint64_t cycles, int fuzz, uint64_t seed) {
+  Diff diff = { .model = model, .step = step < 1 ? 1 : step, .cycles = cycles,
+                .fuzz = fuzz, .seed = seed, .name = { a, b } };
+  for (int k = 0; k < 2; k++) {
+    for (int i = 0; i < DIFF_BACKENDS; i++)
+      if (strcmp(diff.name[k], DiffBackends[i].name) == 0)
+        diff.run[k] = DiffBackends[i].run;
+    if (diff.run[k] == NULL) {
+      printf("error: Unknown core %s, the choices are:", diff.name[k]);
+      for (int i = 0; i < DIFF_BACKENDS; i++)
+        printf(" %s", DiffBackends[i].name);
+      printf("\n");
+      return 1;
+    }
+  }
+  double start = Seconds();
+  int differ = DiffSession(&diff, UINT64_MAX);
+  double took = Seconds() - start;
+  // A budget of 1 runs exactly one instruction
+  const char *unit = diff.step == 1 ? "instructions" : "steps";
+  printf("%s vs %s: %llu %s", a, b, (unsigned long long) diff.steps, unit);
+  if (diff.step > 1)
+    printf(" of %d cycles", diff.step);
+  if (fuzz)
+    printf(", %llu random cases from seed %llu",
+           (unsigned long long) diff.cases, (unsigned long long) seed);
+  printf(" in %.3f s, %.2f M %s/s\n", took, diff.steps / took / 1e6, unit);
+  // Then the mirrors, which the game and random code hardly ever copy
+  // through
+  if (!differ) {
+    if (DiffMirrors(&diff))
+      return 1;
+    printf("no differences\n");
+    return 0;
+  }
+  printf("%s and %s differ by cycle %llu: %s\n", a, b,
+         (unsigned long long) diff.found, diff.what);
+  // Run it all again, one instruction at a time from the last check that
+  // passed. Blocks that only go wrong when run whole can slip through.
+  if (!DiffSession(&diff, diff.clean))
+    printf("no difference one instruction at a time: it needs steps of %d "
+           "cycles\n", diff.step);
+  return 1;
+}
+
+/**
+ * Sets a breakpoint from a --break argument, ADDR or ADDR:REG=VALUE, e.g.
+ * 0x1a32 or 0x1a32:b=0x10. Returns -1 if it makes no sense.
+ */
+static int ParseBreak(State8080 *state, const char *arg) {
+  static const char *const names[] = {
+    "", "a", "b", "c", "d", "e", "h", "l", "bc", "de", "hl", "sp",
+  };
+  char *rest;
+  unsigned long pc = strtoul(arg, &rest, 0);
+  if (rest == arg || pc > 0xffff)
+    return -1;
+  if (*rest == '\0')
+    return DebugAddBreak(state, pc, REG_NONE, 0);
+  const char *eq = strchr(rest, '=');
+  if (*rest != ':' || eq == NULL)
+    return -1;
+  for (int reg = REG_A; reg <= REG_SP; reg++) {
+    if (strlen(names[reg]) == (size_t) (eq - rest - 1) &&
+        strncmp(rest + 1, names[reg], eq - rest - 1) == 0) {
+      unsigned long value = strtoul(eq + 1, &rest, 0);
+      if (rest == eq + 1 || *rest != '\0' || value > 0xffff)
+        return -1;
+      return DebugAddBreak(state, pc, reg, value);
+    }
+  }
+  return -1;
+}
+
+/**
+ * Sets a watchpoint from a --watch argument, FIRST[-LAST][:r|w|rw], e.g.
+ * 0x20c0 or 0x2400-0x3fff:w. Without a kind it watches writes.
+ */
+static int ParseWatch(State8080 *state, const char *arg) {
+  char *rest;
+  unsigned long first = strtoul(arg, &rest, 0), last = first;
+  if (rest == arg)
+    return -1;
+  if (*rest == '-') {
+    const char *from = rest + 1;
+    last = strtoul(from, &rest, 0);
+    if (rest == from)
+      return -1;
+  }
+  int kind = DEBUG_WRITE;
+  if (strcmp(rest, ":r") == 0)
+    kind = DEBUG_READ;
+  else if (strcmp(rest, ":rw") == 0)
+    kind = DEBUG_READ | DEBUG_WRITE;
+  else if (*rest != '\0' && strcmp(rest, ":w") != 0)
+    return -1;
+  if (last > 0xffff)
+    return -1;
+  return DebugAddWatch(state, first, last, kind);
+}
+
+// Says why a machine stopped, with the instruction and the registers
+static void DebugPrintHit(const State8080 *state) {
+  const DebugHit *hit = &state->debug->hit;
+  char line[DISASSEMBLY_SIZE];
+  Format8080(line, &state->memory[hit->pc], hit->pc);
+  if (hit->kind == DEBUG_EXEC)
+    printf("stopped at a breakpoint, in front of\n");
+  else
+    printf("stopped after a %s of $%02x at %04x by\n",
+           hit->kind == DEBUG_READ ? "read" : "write", hit->value, hit->adr);
+  printf("  %s\n  A %02x B %02x C %02x D %02x E %02x H %02x L %02x "
+         "PSW %02x SP %04x PC %04x cycles %llu\n", line, state->a, state->b,
+         state->c, state->d, state->e, state->h, state->l,
+         LazyFlagsPSW(LazyFlagsFromCC(state->cc)), state->sp, state->pc,
+         (unsigned long long) state->cycles);
+}
+
+/**
+ * int argc - the # of args passed into the program, always at least 1, since
+ * the first arg is the call to the program itself
+ *
+ * char **argv - pointer to a char *, since C-style strings are just char *
+ * arrays, this could be also written as char *argv[] (array of char *)
+ *
+ */
+int main(int argc, char **argv) {
+  TraceLevel trace = TRACE_OFF;
+  uint32_t trace_depth = 64;
+  // Emulate8080Op is kept as the reference; the threaded engine is the default
+  Backend8080 run = Run8080;
+  // Run forever unless --frames says otherwise
+  uint64_t end = UINT64_MAX;
+  const char *screenshot = NULL;
+  // Snapshots to start from and to save on exit
+  const char *load = NULL, *save = NULL;
+  // More than 0 runs that many machines side by side instead of one
+  int instances = 0;
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  // --core=batch: run the instances in lockstep batches
+  int batched = 0;
+  // Input logs to write, or to play back instead of running the game
+  const char *record = NULL, *replay = NULL;
+  // --wav: the sound goes to this file, made from the samples in `samples`
+  const char *wav = NULL, *samples = NULL;
+  // --video: frames go to this file from a presentation thread
+  const char *video = NULL;
+  // Which of RomManifests to run, and where its files are
+  const char *romset = "invaders", *rom_dir = ".";
+  // --bench runs the benchmarks instead, all of them or just `bench_only`
+  int bench = 0;
+  const char *bench_only = NULL;
+  // --realtime: run at the cabinet's speed instead of flat out
+  int realtime = 0;
+  // --profile: lines per table of the report, 0 for no profile
+  int profile = 0;
+  // --diff=A,B: run two cores in lockstep, on the game or on random code
+  const char *diff = NULL;
+  int diff_step = 1, fuzz = 0;
+  uint64_t seed = 1;
+  // --disassemble: list the ROM and exit
+  int disassemble = 0;
+  // --break and --watch, set once the machine is loaded
+  const char *breaks[DEBUG_BREAKS + DEBUG_WATCHES];
+  int debug_count = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--trace=off") == 0) {
+      trace = TRACE_OFF;
+    } else if (strcmp(argv[i], "--trace=ring") == 0) {
+      trace = TRACE_RING;
+    } else if (strcmp(argv[i], "--trace=full") == 0) {
+      trace = TRACE_FULL;
+    } else if (strncmp(argv[i], "--trace-depth=", 14) == 0) {
+      trace_depth = strtoul(argv[i] + 14, NULL, 0);
+      if (trace_depth == 0)
+        trace_depth = 1;
+    } else if (strcmp(argv[i], "--core=switch") == 0) {
+      run = RunSwitch8080;
+    } else if (strcmp(argv[i], "--core=threaded") == 0) {
+      run = Run8080;
+    } else if (strcmp(argv[i], "--core=cached") == 0) {
+      run = RunCached8080;
+    } else if (strcmp(argv[i], "--core=batch") == 0) {
+      batched = 1;
+    } else if (strncmp(argv[i], "--frames=", 9) == 0) {
+      end = strtoull(argv[i] + 9, NULL, 0) * FRAME_CYCLES;
+    } else if (strncmp(argv[i], "--screenshot=", 13) == 0) {
+      screenshot = argv[i] + 13;
+    } else if (strncmp(argv[i], "--load=", 7) == 0) {
+      load = argv[i] + 7;
+    } else if (strncmp(argv[i], "--save=", 7) == 0) {
+      save = argv[i] + 7;
+    } else if (strncmp(argv[i], "--instances=", 12) == 0) {
+      instances = atoi(argv[i] + 12);
+    } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+      threads = atoi(argv[i] + 10);
+    } else if (strncmp(argv[i], "--record=", 9) == 0) {
+      record = argv[i] + 9;
+    } else if (strncmp(argv[i], "--replay=", 9) == 0) {
+      replay = argv[i] + 9;
+    } else if (strncmp(argv[i], "--romset=", 9) == 0) {
+      romset = argv[i] + 9;
+    } else if (strncmp(argv[i], "--roms=", 7) == 0) {
+      rom_dir = argv[i] + 7;
+    } else if (strcmp(argv[i], "--profile") == 0) {
+      profile = 20;
+    } else if (strncmp(argv[i], "--profile=", 10) == 0) {
+      profile = atoi(argv[i] + 10);
+    } else if (strcmp(argv[i], "--realtime") == 0) {
+      realtime = 1;
+    } else if (strcmp(argv[i], "--bench") == 0) {
+      bench = 1;
+    } else if (strncmp(argv[i], "--bench=", 8) == 0) {
+      bench = 1;
+      bench_only = argv[i] + 8;
+    } else if ((strncmp(argv[i], "--break=", 8) == 0 ||
+                strncmp(argv[i], "--watch=", 8) == 0) &&
+               debug_count < DEBUG_BREAKS + DEBUG_WATCHES) {
+      breaks[debug_count++] = argv[i];
+    } else if (strcmp(argv[i], "--disassemble") == 0) {
+      disassemble = 1;
+    } else if (strncmp(argv[i], "--diff=", 7) == 0) {
+      diff = argv[i] + 7;
+    } else if (strncmp(argv[i], "--diff-step=", 12) == 0) {
+      diff_step = atoi(argv[i] + 12);
+    } else if (strcmp(argv[i], "--fuzz") == 0) {
+      fuzz = 1;
+    } else if (strncmp(argv[i], "--fuzz=", 7) == 0) {
+      fuzz = 1;
+      seed = strtoull(argv[i] + 7, NULL, 0);
+    } else if (strncmp(argv[i], "--wav=", 6) == 0) {
+      wav = argv[i] + 6;
+    } else if (strncmp(argv[i], "--samples=", 10) == 0) {
+      samples = argv[i] + 10;
+    } else if (strncmp(argv[i], "--video=", 8) == 0) {
+      video = argv[i] + 8;
+    } else {
+      printf("usage: %s [--core=threaded|cached|switch|batch] "
+             "[--trace=off|ring|full] [--trace-depth=N] [--frames=N] "
+             "[--screenshot=FILE.ppm] "
+             "[--load=FILE] [--save=FILE] [--instances=N] [--threads=N] "
+             "[--record=FILE] [--replay=FILE] [--romset=NAME] [--roms=DIR] "
+             "[--bench[=NAME]] [--realtime] [--profile[=N]] "
+             "[--diff=CORE,CORE] [--diff-step=N] [--fuzz[=SEED]] "
+             "[--disassemble] [--break=ADDR[:REG=VALUE]] "
+             "[--watch=FIRST[-LAST][:r|w|rw]] [--wav=FILE] [--samples=DIR] "
+             "[--video=FILE]\n",
+             argv[0]);
+      return 1;
+    }
+  }
+
+  if (batched && instances == 0) {
+    printf("--core=batch runs several machines, so it needs --instances\n");
+    return 1;
+  }
+  if (profile > 0 && instances > 0) {
+    printf("--profile runs a single machine, not --instances\n");
+    return 1;
+  }
+  // Whatever --core says: the profiler is a copy of the threaded core
+  if (profile > 0)
+    run = RunProfiled8080;
+  if (bench && (batched || instances > 0)) {
+    printf("--bench runs a single machine, not --instances\n");
+    return 1;
+  }
+  if ((record != NULL || replay != NULL) && instances > 0) {
+    printf("--record and --replay run a single machine, not --instances\n");
+    return 1;
+  }
+  // The frame hashes are taken between the half-frame slices of the
+  // untraced loop, which is what a replay runs
+  if (record != NULL && trace != TRACE_OFF) {
+    printf("--record needs --trace=off\n");
+    return 1;
+  }
+  if (diff != NULL && (instances > 0 || strchr(diff, ',') == NULL)) {
+    printf("--diff takes two cores, e.g. --diff=threaded,cached, and runs "
+           "no --instances\n");
+    return 1;
+  }
+  if (fuzz && diff == NULL) {
+    printf("--fuzz needs --diff\n");
+    return 1;
+  }
+  if (debug_count > 0 && instances > 0) {
+    printf("--break and --watch work on a single machine, not --instances\n");
+    return 1;
+  }
+  if (realtime && (trace != TRACE_OFF || instances > 0)) {
+    printf("--realtime runs a single machine with --trace=off\n");
+    return 1;
+  }
+  if (wav != NULL && (trace != TRACE_OFF || instances > 0)) {
+    printf("--wav records a single machine with --trace=off\n");
+    return 1;
+  }
+  if (video != NULL && (trace != TRACE_OFF || instances > 0)) {
+    printf("--video shows a single machine with --trace=off\n");
+    return 1;
+  }
+
+  State8080* state = Init8080();
+
+  const RomSet *roms = RomSetOpen(romset, rom_dir);
+  if (roms == NULL)
+    return 1;
+  LoadRomSet(state, roms);
+  InvadersScheduleInterrupts(state);
+
+  if (disassemble) {
+    uint8_t *kind = malloc(ROM_SIZE);
+    char *text = malloc(ROM_SIZE * DISASSEMBLY_SIZE + 1);
+    double start = Seconds();
+    int count = AnalyzeCode8080(state->memory, ROM_SIZE, kind);
+    size_t length = ListCode8080(text, state->memory, ROM_SIZE, kind);
+    double took = Seconds() - start;
+    int code = 0;
+    for (int i = 0; i < ROM_SIZE; i++)
+      code += kind[i] != BYTE_DATA;
+    printf("; %d instructions in %d bytes of code, %d bytes of data, "
+           "found and listed in %.0f us\n", count, code, ROM_SIZE - code,
+           took * 1e6);
+    fwrite(text, 1, length, stdout);
+    free(text);
+    free(kind);
+    Free8080(state);
+    return 0;
+  }
+
+  if (bench) {
+    int bad = RunBenchmarks(state, run, bench_only);
+    Free8080(state);
+    return bad > 0;
+  }
+
+  if (replay != NULL) {
+    InputLog *log = InputLogLoad(replay);
+    if (log == NULL)
+      return 1;
+    double start = Seconds();
+    int matched = InputLogReplay(log, state, run);
+    double took = Seconds() - start;
+    if (matched < 0) {
+      printf("error: %s was recorded with another ROM set\n", replay);
+      return 1;
+    }
+    double game = (double) log->next_frame / FRAME_HZ;
+    printf("replayed %u of %u frames (%.1f s of game time) in %.3f s, %.0fx "
+           "real time\n", log->next_frame, log->frames, game, took,
+           game / took);
+    if (log->bad_read != 0)
+      printf("IN at cycle %llu is not the one logged\n",
+             (unsigned long long) log->bad_read);
+    if (log->bad_frame != 0)
+      printf("RAM differs from the recording at the end of frame %u\n",
+             log->bad_frame);
+    else if (matched)
+      printf("RAM matched the recording at every frame boundary\n");
+    InputLogFree(log, state);
+    Free8080(state);
+    return !matched;
+  }
+  if (load != NULL && LoadStateFile(state, load) != 0)
+    return 1;
+  if (diff != NULL) {
+    char a[32];
+    snprintf(a, sizeof(a), "%.*s", (int) (strchr(diff, ',') - diff), diff);
+    // --frames of game time or of random code, 10 seconds' worth without
+    int differ = RunDiff(state, a, strchr(diff, ',') + 1, diff_step,
+                         end == UINT64_MAX ? 600 * FRAME_CYCLES : end, fuzz,
+                         seed);
+    Free8080(state);
+    return differ;
+  }
+  // --frames counts on from the start of the frame the snapshot was taken
+  // in, so that a run split in two ends where the whole run would have
+  if (end != UINT64_MAX)
+    end += state->cycles - state->cycles % FRAME_CYCLES;
+  for (int i = 0; i < debug_count; i++) {
+    const char *arg = breaks[i] + 8;
+    int bad = breaks[i][2] == 'b' ? ParseBreak(state, arg)
+                                  : ParseWatch(state, arg);
+    if (bad) {
+      printf("error: Cannot set %s\n", breaks[i]);
+      return 1;
+    }
+  }
+
+  if (instances > 0) {
+    // Without --frames, run 10 seconds of game time
+    if (end == UINT64_MAX)
+      end = state->cycles - state->cycles % FRAME_CYCLES + 600 * FRAME_CYCLES;
+    Fleet *fleet = batched ? FleetNewBatched(state, instances, threads)
+                           : FleetNew(state, instances, threads, run);
+    double start = Seconds();
+    FleetRun(fleet, end);
+    double took = Seconds() - start;
+    uint64_t frames = fleet->frame;
+    uint64_t cycles = 0;
+    int faults = 0;
+    for (int i = 0; i < fleet->count; i++) {
+      cycles += fleet->machines[i]->cycles - state->cycles;
+      faults += fleet->machines[i]->fault;
+    }
+    printf("%d machines on %d threads, %llu frames each: %.3f s, "
+           "%.1f emulated MHz in all, %.0f frames/s\n",
+           instances, fleet->threads, (unsigned long long) frames, took,
+           cycles / took / 1e6, instances * frames / took);
+    if (faults > 0)
+      printf("%d machines stopped on a fault\n", faults);
+    if (screenshot != NULL) {
+      uint32_t *frame = malloc(SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(uint32_t));
+      RenderFrameRGBA(&fleet->machines[0]->memory[VRAM_START], frame);
+      WriteFramePPM(screenshot, frame);
+      free(frame);
+    }
+    if (save != NULL)
+      SaveStateFile(fleet->machines[0], save);
+    FleetFree(fleet);
+    Free8080(state);
+    return faults > 0;
+  }
+
+  // Each trace level gets its own loop so that the untraced one is exactly
+  // the bare dispatch loop, with no per-instruction check of the level. The
+  // traced loops run one instruction at a time: any instruction takes at
+  // least 4 cycles, so a budget of 1 runs exactly one.
+  // A CPU halted with interrupts off can never wake up again, so stop there.
+  InputLog *log = record != NULL ? InputLogRecord(state) : NULL;
+  Mixer *mixer = NULL;
+  if (wav != NULL && (mixer = MixerNew(state, wav, samples)) == NULL)
+    return 1;
+  Presenter *presenter = NULL;
+  if (video != NULL && (presenter = PresenterNew(video)) == NULL)
+    return 1;
+#define RUNNING (!(state->halted && !state->int_enable) && \
+                 state->cycles < end && \
+                 !(state->debug != NULL && state->debug->hit.kind != 0))
+  if (realtime) {
+    // The same slices as the untraced loop. The first half of a frame runs
+    // as soon as the last frame is out, the second half as late as it can,
+    // then the frame is drawn and presented on the dot.
+    Pacer pacer;
+    PacerStart(&pacer, FRAME_HZ);
+    uint32_t *frame = malloc(SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(uint32_t));
+    RenderFrameRGBA(&state->memory[VRAM_START], frame);
+    while (RUNNING) {
+      RunHalfFrame8080(state, run);
+      if (log != NULL)
+        InputLogFrame(log, state);
+      if (mixer != NULL)
+        MixerTick(mixer, state);
+      PacerWaitForLateHalf(&pacer);
+      double start = Seconds();
+      RunHalfFrame8080(state, run);
+      if (presenter != NULL)
+        TripleBufferPublish(presenter->frames, state);
+      else
+        RenderDirtyFrameRGBA(state, frame);
+      if (mixer != NULL)
+        MixerTick(mixer, state);
+      PacerHalfTook(&pacer, Seconds() - start);
+      if (log != NULL)
+        InputLogFrame(log, state);
+      PacerPresent(&pacer);
+    }
+    free(frame);
+    PacerReport(&pacer);
+  } else switch (trace) {
+  case TRACE_OFF: {
+    // Run in half-frame slices, each up to the frame's middle or end
+    // whatever the last one overshot by. A frame is published each time a
+    // slice crosses into the next frame.
+    uint64_t frame = state->cycles / FRAME_CYCLES;
+    while (RUNNING) {
+      RunHalfFrame8080(state, run);
+      if (log != NULL)
+        InputLogFrame(log, state);
+      if (mixer != NULL)
+        MixerTick(mixer, state);
+      if (presenter != NULL && state->cycles / FRAME_CYCLES != frame) {
+        frame = state->cycles / FRAME_CYCLES;
+        TripleBufferPublish(presenter->frames, state);
+      }
+    }
+    break;
+  }
+  case TRACE_RING:
+    state->trace = TraceRingNew(trace_depth);
+    while (RUNNING) {
+      TraceRecord(state->trace, state);
+      RunScheduled8080(state, run, 1);
+    }
+    break;
+  case TRACE_FULL:
+    while (RUNNING) {
+      Disassemble8080Op(state->memory, state->pc);
+      RunScheduled8080(state, run, 1);
+    }
+    break;
+  }
+#undef RUNNING
+  if (mixer != NULL) {
+    MixerClose(mixer, state);
+    MixerReport(mixer);
+    MixerFree(mixer);
+  }
+  if (presenter != NULL) {
+    PresenterClose(presenter);
+    PresenterReport(presenter);
+    PresenterFree(presenter);
+  }
+  if (log != NULL) {
+    InputLogSave(log, state, record);
+    InputLogFree(log, state);
+  }
+  if (state->profile != NULL)
+    ProfileReport(state->profile, state->memory, profile);
+  if (state->debug != NULL && state->debug->hit.kind != 0)
+    DebugPrintHit(state);
+
+  if (screenshot != NULL) {
+    uint32_t *frame = malloc(SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(uint32_t));
+    RenderFrameRGBA(&state->memory[VRAM_START], frame);
+    WriteFramePPM(screenshot, frame);
+    free(frame);
+  }
+  if (save != NULL)
+    SaveStateFile(state, save);
+
+  int fault = state->fault;
+  Free8080(state);
+  return fault;
 }